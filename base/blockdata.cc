@@ -4,7 +4,7 @@
 
 #include <algorithm>
 
-BlockData::BlockData(BlockDataParams params) {
+BlockData::BlockData(BlockDataParams params): id(params.id) {
     if (params.texture != "") {
         for (int i = 0; i < 6; i ++) {
             texture_paths[i] = params.texture;
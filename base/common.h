@@ -60,6 +60,7 @@ class SingleGame;
 class Pool;
 class BlockFileSystem;
 class BlockFileFormat;
+class GenerationCache;
 class Entity;
 
 
@@ -4,8 +4,12 @@
 #include "blockiter.h"
 #include "blockdata.h"
 
+#include "terrain.h"
+
 #include <sstream>
 #include <fstream>
+#include <filesystem>
+#include <thread>
 
 DEFINE_PLUGIN(BlockFileSystem);
 
@@ -20,10 +24,14 @@ BlockFileSystem::~BlockFileSystem() {
 
 EXPORT_PLUGIN(IndividualFileSystem);
 
-bool IndividualFileSystem::from_file(NodeView node) {
+string IndividualFileSystem::path(ivec3 position, int scale) {
 	std::ostringstream path;
-	path << dirpath << node.position.x << "x" << node.position.y << "y" << node.position.z << "z" << node.scale << ".txt";
-	std::ifstream ifile (path.str(), std::ios::binary);
+	path << dirpath << position.x << "x" << position.y << "y" << position.z << "z" << scale << ".txt";
+	return path.str();
+}
+
+bool IndividualFileSystem::from_file(NodeView node) {
+	std::ifstream ifile (path(node.position, node.scale), std::ios::binary);
 	if (ifile.good()) {
 		fileformat->from_file(node, ifile);
 		return true;
@@ -32,10 +40,208 @@ bool IndividualFileSystem::from_file(NodeView node) {
 }
 
 void IndividualFileSystem::to_file(NodeView node) {
-	std::ostringstream path;
-	path << dirpath << node.position.x << "x" << node.position.y << "y" << node.position.z << "z" << node.scale << ".txt";
-	std::ofstream ofile (path.str(), std::ios::binary);
+	// written to a temp file first, so a save that is cut
+	// off is never mistaken for a whole chunk
+	string filepath = path(node.position, node.scale);
+	std::ostringstream temppath;
+	temppath << filepath << "." << std::this_thread::get_id() << ".tmp";
+	std::ofstream ofile (temppath.str(), std::ios::binary);
 	fileformat->to_file(node, ofile);
+	ofile.close();
+	
+	std::error_code error;
+	if (ofile.good()) {
+		std::filesystem::rename(temppath.str(), filepath, error);
+	} else {
+		std::filesystem::remove(temppath.str(), error);
+	}
+}
+
+bool IndividualFileSystem::has_file(ivec3 position, int scale) {
+	std::error_code error;
+	return std::filesystem::exists(path(position, scale), error);
+}
+
+
+
+// fnv-1a, used instead of std::hash because the
+// fingerprints have to be the same between runs
+static uint64 hash_bytes(uint64 hash, const void* data, int size) {
+	const uint8* bytes = (const uint8*) data;
+	for (int i = 0; i < size; i ++) {
+		hash = (hash ^ bytes[i]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+template <typename T>
+static uint64 hash_value(uint64 hash, const T& val) {
+	return hash_bytes(hash, &val, sizeof(T));
+}
+
+static uint64 hash_value(uint64 hash, const string& val) {
+	return hash_bytes(hash, val.data(), val.size());
+}
+
+
+bool PARAM(generation_cache) = true;
+
+GenerationCache::GenerationCache(string basepath, TerrainGenerator* gen): generator(gen) {
+	fileformat = BlockFileFormat::plugnew();
+	
+	std::ostringstream path;
+	path << basepath << generator->get_plugindef()->id << "-v" << generator->version() << "/" << generator->seed << "/";
+	dirpath = path.str();
+	
+	std::error_code error;
+	std::filesystem::create_directories(dirpath, error);
+	enabled = generation_cache and !error;
+	
+	// anything that changes the generated terrain or how it is saved
+	fingerprint = 14695981039346656037ull;
+	fingerprint = hash_value(fingerprint, generator->fingerprint());
+	fingerprint = hash_value(fingerprint, BDIMS);
+	fingerprint = hash_value(fingerprint, entry_version);
+	for (BlockData* data : BlockData::allblocks) {
+		fingerprint = hash_value(fingerprint, data->id);
+		fingerprint = hash_value(fingerprint, data->texture_paths[0]);
+	}
+}
+
+GenerationCache::~GenerationCache() {
+	plugdelete(fileformat);
+}
+
+string GenerationCache::path(ivec3 position, int scale, int depth) {
+	std::ostringstream path;
+	path << dirpath << position.x << "x" << position.y << "y" << position.z << "z"
+		<< scale << "s" << depth << "d.txt";
+	return path.str();
+}
+
+bool GenerationCache::has_entry(istream& ifile) {
+	uint64 filefingerprint = 0;
+	ifile.read((char*)&filefingerprint, sizeof(filefingerprint));
+	return ifile.good() and filefingerprint == fingerprint;
+}
+
+// flags are not saved by the file format, so the leaves the generator left
+// unfinished (see TerrainGenerator::generate_chunk) are stored after the
+// chunk, as their index in BlockIter order
+void GenerationCache::write_unfinished(NodeView node, ostream& ofile) {
+	vector<int32> unfinished;
+	int32 index = 0;
+	for (NodeView leaf : node.iter<BlockIter>()) {
+		if (leaf.test_flag(Block::GENERATION_FLAG)) {
+			unfinished.push_back(index);
+		}
+		index ++;
+	}
+	int32 count = unfinished.size();
+	ofile.write((char*)&count, sizeof(count));
+	ofile.write((char*)unfinished.data(), count * sizeof(int32));
+}
+
+void GenerationCache::read_unfinished(NodeView node, istream& ifile) {
+	int32 count = 0;
+	ifile.read((char*)&count, sizeof(count));
+	vector<int32> unfinished (std::max(count, 0));
+	ifile.read((char*)unfinished.data(), unfinished.size() * sizeof(int32));
+	if (!ifile.good()) {
+		return;
+	}
+	
+	int32 index = 0;
+	int next = 0;
+	for (NodeView leaf : node.iter<BlockIter>()) {
+		if (next < int(unfinished.size()) and unfinished[next] == index) {
+			leaf.set_flag(Block::GENERATION_FLAG);
+			next ++;
+		}
+		index ++;
+	}
+}
+
+void GenerationCache::write_entry(string filepath, const string& data) {
+	// written to a temp file first so a half written
+	// entry is never read by another thread or run
+	std::ostringstream temppath;
+	temppath << filepath << "." << std::this_thread::get_id() << ".tmp";
+	std::ofstream ofile (temppath.str(), std::ios::binary);
+	ofile.write((char*)&fingerprint, sizeof(fingerprint));
+	ofile.write(data.data(), data.size());
+	ofile.close();
+	
+	std::error_code error;
+	if (ofile.good()) {
+		std::filesystem::rename(temppath.str(), filepath, error);
+	} else {
+		std::filesystem::remove(temppath.str(), error);
+	}
+}
+
+void GenerationCache::generate_chunk(NodeView node, int depth) {
+	// generated again from nothing, the generators and the file format
+	// both expect a node without children
+	if (node.haschildren()) {
+		node.join();
+	}
+	
+	if (!enabled) {
+		generator->generate_chunk(node, depth);
+		return;
+	}
+	
+	string filepath = path(node.position, node.scale, depth);
+	std::ifstream ifile (filepath, std::ios::binary);
+	if (ifile.good() and has_entry(ifile)) {
+		fileformat->from_file(node, ifile);
+		read_unfinished(node, ifile);
+		hits ++;
+		return;
+	}
+	ifile.close();
+	
+	misses ++;
+	generator->generate_chunk(node, depth);
+	
+	std::ostringstream data;
+	fileformat->to_file(node, data);
+	write_unfinished(node, data);
+	write_entry(filepath, data.str());
+}
+
+bool GenerationCache::pregenerate(ivec3 position, int scale, int depth) {
+	if (!enabled) {
+		return false;
+	}
+	
+	string filepath = path(position, scale, depth);
+	std::ifstream ifile (filepath, std::ios::binary);
+	if (ifile.good() and has_entry(ifile)) {
+		return false;
+	}
+	ifile.close();
+	
+	// streams have no flags, so chunks that can have
+	// unfinished nodes are made as octrees
+	string data;
+	bool full = TerrainGenerator::depth_scale(scale, depth) == 1;
+	if (full and dynamic_cast<SequentialFileFormat*>(fileformat) != nullptr) {
+		generator->generate_stream(position, scale, depth, &data);
+		// and no unfinished leaves
+		int32 count = 0;
+		data.append((char*)&count, sizeof(count));
+	} else {
+		BlockContainer container (position, scale);
+		generator->generate_chunk(container, depth);
+		std::ostringstream stream;
+		fileformat->to_file(container, stream);
+		write_unfinished(container, stream);
+		data = stream.str();
+	}
+	write_entry(filepath, data);
+	return true;
 }
 
 
@@ -48,6 +254,7 @@ EXPORT_PLUGIN(SequentialFileFormat);
 void SequentialFileFormat::from_file(NodePtr node, istream& ifile) {
 	vector<BlockData*> blockarr;
 	for (BlockData* data : BlockData::allblocks) {
+		if (data->id == 0) continue;
 		if (data->id > blockarr.size()) {
 			blockarr.resize(data->id, nullptr);
 		}
@@ -72,7 +279,8 @@ void SequentialFileFormat::to_file(NodePtr node, ostream& ofile) {
 		if (curnode.haschildren()) {
 			ofile.put('{');
 		} else if (curnode.hasblock()) {
-			ofile.put(curnode.block()->type->id);
+			BlockData* type = curnode.block()->type;
+			ofile.put(type == nullptr ? 0 : type->id);
 		} else {
 			ofile.put('~');
 		}
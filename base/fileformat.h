@@ -6,6 +6,7 @@
 
 #include "blocks.h"
 #include <fstream>
+#include <atomic>
 
 class BlockFileSystem {
 	BASE_PLUGIN(BlockFileSystem, (string dirpath));
@@ -17,6 +18,8 @@ public:
 	
 	virtual void to_file(NodeView node) = 0;
 	virtual bool from_file(NodeView node) = 0;
+	// true if the chunk was saved before
+	virtual bool has_file(ivec3 position, int scale) = 0;
 	
 protected:
 	BlockFileFormat* fileformat;
@@ -30,6 +33,10 @@ public:
 	using BlockFileSystem::BlockFileSystem;
 	virtual void to_file(NodeView node);
 	virtual bool from_file(NodeView node);
+	virtual bool has_file(ivec3 position, int scale);
+	
+protected:
+	string path(ivec3 position, int scale);
 };
 
 
@@ -40,6 +47,48 @@ public:
 
 
 
+// Caches the terrain made by a generator on disk, so terrain that was
+// generated before is read from a file instead of generated again.
+// Entries are stored by generator id and version, seed, position and
+// scale, and each file starts with a fingerprint of the generator settings
+// and block ids, entries with a different fingerprint are regenerated
+class GenerationCache {
+public:
+	string dirpath;
+	bool enabled;
+	std::atomic<int64> hits = 0;
+	std::atomic<int64> misses = 0;
+	
+	GenerationCache(string basepath, TerrainGenerator* generator);
+	~GenerationCache();
+	
+	// loads the chunk from the cache, or generates it and adds it to the cache.
+	// Any children the node has are joined first
+	void generate_chunk(NodeView node, int depth);
+	// adds the chunk to the cache without loading it, returning false if it
+	// was already there. No nodes are made when the format is sequential
+	bool pregenerate(ivec3 position, int scale, int depth);
+	
+protected:
+	// changed whenever the layout of the entries changes
+	static constexpr int entry_version = 2;
+	
+	TerrainGenerator* generator;
+	BlockFileFormat* fileformat;
+	uint64 fingerprint;
+	
+	string path(ivec3 position, int scale, int depth);
+	// true if the file is an entry made with the current fingerprint
+	bool has_entry(istream& ifile);
+	void write_entry(string filepath, const string& data);
+	static void write_unfinished(NodeView node, ostream& ofile);
+	static void read_unfinished(NodeView node, istream& ifile);
+};
+
+
+
+
+
 class BlockFileFormat {
 	BASE_PLUGIN(BlockFileFormat, ());
 public:
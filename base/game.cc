@@ -11,16 +11,21 @@
 #include "blockdata.h"
 
 #include <set>
+#include <algorithm>
 #include <sstream>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <thread>
+#include <chrono>
 #include <mutex>
 #include <condition_variable>
 #include <map>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
 
 DEFINE_PLUGIN(Game);
 
@@ -30,10 +35,27 @@ EXPORT_PLUGIN(SingleTreeGame);
 
 int PARAM(worldsize) = 8;
 
-const int renderdistance = worldsize;  // FIX THIS VARIABLE NAME
+// the loaded chunks are a cube of this many chunks on
+// each side of the chunk the player is in
 const int chunkloadingstart = 3;
 
-const int chunks = (2*chunkloadingstart + 1) * (2*chunkloadingstart + 1) *(2*chunkloadingstart + 1);
+// chunks around where the player will be in this many seconds, at its
+// current velocity, are loaded before it gets there
+float PARAM(prefetch_seconds) = 1;
+// at most this many chunks outside of the cube are loaded ahead
+int PARAM(prefetch_chunks) = 64;
+
+// the spectator's movement is saved to this file when the game closes
+string PARAM(record_path) = string("");
+// the spectator follows the movement in this file instead of the controls,
+// and the game closes at the end, writing stats about how it ran
+string PARAM(replay_path) = string("");
+// file the replay stats are written to, or the console if it is empty
+string PARAM(replay_stats) = string("");
+
+// ticks per second of the spectator and streaming, which run
+// on their own thread instead of once each frame
+int PARAM(sim_tick_rate) = 60;
 
 const bool overwrite_saves = false;
 
@@ -43,17 +65,311 @@ const bool multi_thread_loading_chunks = true;
 Pool* jobPool;
 
 
+ChunkIndex::ChunkIndex(int capacity): slots(capacity) {
+	ASSERT((capacity & (capacity-1)) == 0);
+}
+
+int ChunkIndex::home(ivec3 pos) const {
+	return uint(hash4(0, pos, 0)) & (slots.size() - 1);
+}
+
+int ChunkIndex::find(ivec3 pos) const {
+	for (int i = home(pos); slots[i].index != -1; i = (i+1) & (slots.size() - 1)) {
+		if (slots[i].position == pos) {
+			return slots[i].index;
+		}
+	}
+	return -1;
+}
+
+void ChunkIndex::insert(ivec3 pos, int index) {
+	// kept at most half full, so the runs of full slots stay short
+	if ((count+1) * 2 > slots.size()) {
+		grow();
+	}
+	int i = home(pos);
+	while (slots[i].index != -1 and slots[i].position != pos) {
+		i = (i+1) & (slots.size() - 1);
+	}
+	count += slots[i].index == -1;
+	slots[i].position = pos;
+	slots[i].index = index;
+}
+
+void ChunkIndex::erase(ivec3 pos) {
+	int mask = slots.size() - 1;
+	int i = home(pos);
+	while (slots[i].index != -1 and slots[i].position != pos) {
+		i = (i+1) & mask;
+	}
+	if (slots[i].index == -1) {
+		return;
+	}
+	
+	// moves back the slots after the hole that would not be
+	// found anymore, instead of leaving a tombstone
+	int hole = i;
+	for (int j = (i+1) & mask; slots[j].index != -1; j = (j+1) & mask) {
+		int jhome = home(slots[j].position);
+		if (((j - jhome) & mask) >= ((j - hole) & mask)) {
+			slots[hole] = slots[j];
+			hole = j;
+		}
+	}
+	slots[hole].index = -1;
+	count --;
+}
+
+int ChunkIndex::size() const {
+	return count;
+}
+
+void ChunkIndex::grow() {
+	vector<Slot> oldslots (slots.size() * 2);
+	oldslots.swap(slots);
+	count = 0;
+	for (const Slot& slot : oldslots) {
+		if (slot.index != -1) {
+			insert(slot.position, slot.index);
+		}
+	}
+}
+
+
+
+ChunkStore::Handle ChunkStore::add(Chunk&& chunk) {
+	int index;
+	if (!freeslots.empty()) {
+		index = freeslots.back();
+		freeslots.pop_back();
+	} else {
+		index = num_slots ++;
+		ASSERT(index < page_size * max_pages);
+		if (pages[index / page_size] == nullptr) {
+			pages[index / page_size] = std::make_unique<Page>();
+		}
+	}
+	Slot& curslot = slot(index);
+	curslot.chunk.emplace(std::move(chunk));
+	count ++;
+	return Handle {index, curslot.generation};
+}
+
+void ChunkStore::remove(Handle handle) {
+	if (get(handle) == nullptr) {
+		return;
+	}
+	Slot& curslot = slot(handle.index);
+	curslot.chunk.reset();
+	curslot.generation ++;
+	freeslots.push_back(handle.index);
+	count --;
+}
+
+Chunk* ChunkStore::get(Handle handle) {
+	if (handle.index < 0 or handle.index >= num_slots) {
+		return nullptr;
+	}
+	Slot& curslot = slot(handle.index);
+	if (curslot.generation != handle.generation or !curslot.chunk) {
+		return nullptr;
+	}
+	return &*curslot.chunk;
+}
+
+ChunkStore::Handle ChunkStore::handle(int index) {
+	return Handle {index, slot(index).generation};
+}
+
+Chunk* ChunkStore::at(int index) {
+	Slot& curslot = slot(index);
+	return curslot.chunk ? &*curslot.chunk : nullptr;
+}
+
+int ChunkStore::size() const {
+	return count;
+}
+
+void ChunkStore::pin(int index) {
+	slot(index).pins ++;
+}
+
+void ChunkStore::unpin(int index) {
+	slot(index).pins --;
+}
+
+bool ChunkStore::pinned(Handle handle) {
+	return get(handle) != nullptr and slot(handle.index).pins > 0;
+}
+
+ChunkStore::Slot& ChunkStore::slot(int index) {
+	return pages[index / page_size]->slots[index % page_size];
+}
+
+ChunkStore::iterator::iterator(ChunkStore* store, int index): store(store), index(index) {
+	while (this->index < store->num_slots and store->at(this->index) == nullptr) {
+		this->index ++;
+	}
+}
+
+Chunk& ChunkStore::iterator::operator*() const {
+	return *store->at(index);
+}
+
+ChunkStore::iterator& ChunkStore::iterator::operator++() {
+	*this = iterator(store, index + 1);
+	return *this;
+}
+
+bool ChunkStore::iterator::operator!=(const iterator& other) const {
+	return index != other.index;
+}
+
+ChunkStore::Handle ChunkStore::iterator::handle() const {
+	return store->handle(index);
+}
+
+ChunkStore::iterator ChunkStore::begin() {
+	return iterator(this, 0);
+}
+
+ChunkStore::iterator ChunkStore::end() {
+	return iterator(this, num_slots);
+}
+
+
+
+// recently unloaded chunks are kept in memory up to this size, in kilobytes
+int PARAM(chunk_cache_kb) = 65536;
+// and after that in the file format up to this size
+int PARAM(chunk_cache_packed_kb) = 65536;
+
+static int64 chunk_bytes(NodePtr chunk) {
+	int64 bytes = sizeof(Chunk);
+	for (NodePtr node : chunk.iter<NodeIter>()) {
+		bytes += sizeof(Node) + (node.hasblock() ? sizeof(Block) : 0);
+	}
+	return bytes;
+}
+
+ChunkCache::ChunkKey ChunkCache::key(ivec3 position) {
+	return ChunkKey(position.x, position.y, position.z);
+}
+
+void ChunkCache::add(Chunk&& chunk) {
+	std::lock_guard guard(lock);
+	ChunkKey chunkkey = key(chunk.position);
+	if (index.count(chunkkey)) {
+		return;
+	}
+	
+	chunks.emplace_front();
+	Entry& entry = chunks.front();
+	entry.position = chunk.position;
+	entry.scale = chunk.scale;
+	entry.chunk.emplace(std::move(chunk));
+	entry.bytes = chunk_bytes(*entry.chunk);
+	index[chunkkey] = chunks.begin();
+	stats.bytes += entry.bytes;
+	shrink();
+}
+
+bool ChunkCache::take(ivec3 position, Chunk* chunk) {
+	std::lock_guard guard(lock);
+	auto iter = index.find(key(position));
+	if (iter == index.end()) {
+		stats.misses ++;
+		return false;
+	}
+	
+	Entry& entry = *iter->second;
+	if (entry.chunk) {
+		*chunk = std::move(*entry.chunk);
+		// the render flags were cleared when it was rendered before
+		chunk->set_all_flags(Block::RENDER_FLAG);
+		stats.hits ++;
+		stats.bytes -= entry.bytes;
+		chunks.erase(iter->second);
+	} else {
+		std::istringstream ifile (entry.packed);
+		SequentialFileFormat().from_file(*chunk, ifile);
+		stats.packed_hits ++;
+		stats.packed_bytes -= entry.bytes;
+		packed.erase(iter->second);
+	}
+	index.erase(iter);
+	return true;
+}
+
+void ChunkCache::shrink() {
+	while (stats.bytes > int64(chunk_cache_kb) * 1024 and !chunks.empty()) {
+		Entry& entry = chunks.back();
+		std::ostringstream ofile;
+		SequentialFileFormat().to_file(*entry.chunk, ofile);
+		
+		packed.emplace_front();
+		Entry& newentry = packed.front();
+		newentry.position = entry.position;
+		newentry.scale = entry.scale;
+		newentry.packed = ofile.str();
+		newentry.bytes = sizeof(Entry) + newentry.packed.size();
+		index[key(entry.position)] = packed.begin();
+		stats.bytes -= entry.bytes;
+		stats.packed_bytes += newentry.bytes;
+		chunks.pop_back();
+	}
+	
+	while (stats.packed_bytes > int64(chunk_cache_packed_kb) * 1024 and !packed.empty()) {
+		Entry& entry = packed.back();
+		stats.drops ++;
+		stats.packed_bytes -= entry.bytes;
+		index.erase(key(entry.position));
+		packed.pop_back();
+	}
+}
+
+ChunkCacheStats ChunkCache::get_stats() {
+	std::lock_guard guard(lock);
+	return stats;
+}
+
+
+
 Chunk::Chunk(SingleGame* newgame, ivec3 pos, int scale): game(newgame), BlockContainer(pos,scale) {
   
 }
 
 BlockContainer* Chunk::find_neighbor(ivec3 pos, int goalscale) {
-  for (Chunk& chunk : game->generatedWorld) {
-    if (chunk.contains(IHitCube(pos, goalscale))) {
-      return &chunk;
-    }
-  }
-  return nullptr;
+	// the chunks are all the same size, so only one can contain the cube
+	ivec3 chunkpos = safefloor(vec3(pos) / float(scale)) * scale;
+	std::lock_guard guard(game->chunkindex_lock);
+	int index = game->chunkindex.find(chunkpos);
+	if (index == -1) {
+		return nullptr;
+	}
+	Chunk* chunk = game->generatedWorld.at(index);
+	if (!chunk->contains(IHitCube(pos, goalscale))) {
+		return nullptr;
+	}
+	if (std::find(pinned.begin(), pinned.end(), index) == pinned.end()) {
+		game->generatedWorld.pin(index);
+		pinned.push_back(index);
+	}
+	return chunk;
+}
+
+void Chunk::unpin_neighbors() {
+	if (pinned.empty()) {
+		return;
+	}
+	{
+		std::lock_guard guard(game->chunkindex_lock);
+		for (int index : pinned) {
+			game->generatedWorld.unpin(index);
+		}
+	}
+	pinned.clear();
+	game->chunk_unpinned.notify_all();
 }
 
 
@@ -68,102 +384,142 @@ SingleGame::SingleGame() {
   filesystem = BlockFileSystem::plugnew("world/chunks/");
   jobPool = new Pool(4);
 
-	generatedWorld.reserve(chunks);
-
  	generator = TerrainGenerator::plugnew(12345);
+	gencache = new GenerationCache("world/gencache/", generator);
+	decorator = TerrainDecorator::plugnew(generator);
+	chunkcache = new ChunkCache();
+	tick_rate = sim_tick_rate;
+	
+	if (replay_path != "") {
+		replaying = path.from_file(replay_path);
+		if (!replaying) {
+			cout << "could not read replay " << replay_path << endl;
+		}
+	}
 
 }
 
 SingleGame::~SingleGame() {
-  run_thread = false;
+  run_sim = false;
+  if (simthread.joinable()) {
+    simthread.join();
+  }
+  {
+    std::lock_guard guard(stream_lock);
+    run_thread = false;
+  }
+  stream_changed.notify_one();
   nick.join();
+  cout << "streaming: " << chunks_missed << " of " << chunks_entered << " chunks entered before they were loaded" << endl;
+  if (record_path != "" and !replaying) {
+    if (path.to_file(record_path)) {
+      cout << "recorded " << path.frames.size() << " frames to " << record_path << endl;
+    } else {
+      cout << "could not write recording " << record_path << endl;
+    }
+  }
+  ChunkCacheStats cachestats = chunkcache->get_stats();
+  cout << "chunk cache: " << cachestats.hits << " hits, " << cachestats.packed_hits << " packed hits, "
+    << cachestats.misses << " misses, " << cachestats.drops << " drops" << endl;
   delete jobPool;
+  delete chunkcache;
+  delete gencache;
+  plugdelete(decorator);
+  plugdelete(generator);
   plugdelete(filesystem);
 	plugdelete(graphics);
 	plugdelete(renderer);
 	plugdelete(controls);
 }
 
-bool SingleGame::chunkStillValid(vec3 chunkPos) {
-	int x_rem = static_cast<int>(spectator.position.x) % renderdistance;
-	int y_rem = static_cast<int>(spectator.position.y) % renderdistance;
-	int z_rem = static_cast<int>(spectator.position.z) % renderdistance;
-
-	if (x_rem < 0) {
-		x_rem += renderdistance;
-	}
-
-	if (y_rem < 0) {
-		y_rem += renderdistance;
-	}
-
-	if(z_rem < 0) {
-		z_rem += renderdistance;
-	}
-
-	ivec3 player_chunk_pos = ivec3(spectator.position.x - x_rem, spectator.position.y - y_rem, spectator.position.z - z_rem);
+ivec3 SingleGame::player_chunk() {
+	return safefloor(spectator.position / float(worldsize)) * worldsize;
+}
 
-	return (chunkPos.x <= player_chunk_pos.x + (chunkloadingstart * worldsize) && chunkPos.x >= player_chunk_pos.x - (chunkloadingstart * worldsize))
-		&&  (chunkPos.y <= player_chunk_pos.y + (chunkloadingstart * worldsize) && chunkPos.y >= player_chunk_pos.y - (chunkloadingstart * worldsize))
-		&&  (chunkPos.z <= player_chunk_pos.z + (chunkloadingstart * worldsize) && chunkPos.z >= player_chunk_pos.z - (chunkloadingstart * worldsize));
+bool SingleGame::in_stream_cube(ivec3 chunkpos, ivec3 center) {
+	ivec3 dist = glm::abs(chunkpos - center);
+	int radius = chunkloadingstart * worldsize;
+	return dist.x <= radius and dist.y <= radius and dist.z <= radius;
 }
 
-vector<ivec3> chunksInRenderDistance(vec3 playerPos) {
-	int x_rem = static_cast<int>(playerPos.x) % renderdistance;
-	int y_rem = static_cast<int>(playerPos.y) % renderdistance;
-	int z_rem = static_cast<int>(playerPos.z) % renderdistance;
+bool SingleGame::is_wanted(ivec3 chunkpos) {
+	return in_stream_cube(chunkpos, stream_current.center) or prefetch_set.find(chunkpos) != -1;
+}
 
-	if (x_rem < 0) {
-		x_rem += renderdistance;
+// calls func for the chunks in the range low to high (inclusive)
+// that are not in the range otherlow to otherhigh
+template <typename Func>
+static void range_difference(int low, int high, int otherlow, int otherhigh, int step, Func func) {
+	for (int val = low; val <= std::min(high, otherlow - step); val += step) {
+		func(val);
 	}
-
-	if (y_rem < 0) {
-		y_rem += renderdistance;
+	for (int val = std::max(low, otherhigh + step); val <= high; val += step) {
+		func(val);
 	}
+}
 
-	if(z_rem < 0) {
-		z_rem += renderdistance;
-	}
+// calls func for each chunk of the cube around center that is not in the
+// cube around other. Only the slabs that differ are visited, so the cost
+// is the number of chunks that changed, not the size of the cube
+template <typename Func>
+static void cube_difference(ivec3 center, ivec3 other, int radius, int step, Func func) {
+	ivec3 low = center - radius, high = center + radius;
+	ivec3 otherlow = other - radius, otherhigh = other + radius;
 	
-	int x = -chunkloadingstart;
-	int y = -chunkloadingstart;
-	int z = -chunkloadingstart;
-
-	vector<ivec3> newChunks = vector<ivec3>();
-	for (int i = 0; i < chunks; i++) {
-		newChunks.push_back(ivec3(playerPos.x - x_rem, playerPos.y - y_rem, playerPos.z - z_rem) + (ivec3(x,y,z)*worldsize));
-		// generatedWorld.push_back(Chunk(this, ivec3(x, y, z)*worldsize, worldsize));
-
-		if (x == chunkloadingstart) {
-			if (z == chunkloadingstart) {
-				if (y == chunkloadingstart) {
-					// Done
-				} else {
-					y++;
-					x = -chunkloadingstart;
-					z = -chunkloadingstart;
+	for (int x = low.x; x <= high.x; x += step) {
+		if (x < otherlow.x or x > otherhigh.x) {
+			for (int y = low.y; y <= high.y; y += step) {
+				for (int z = low.z; z <= high.z; z += step) {
+					func(ivec3(x,y,z));
 				}
-			} else {
-				z++;
-				x = -chunkloadingstart;
 			}
-		} else {
-			x++;
+			continue;
+		}
+		for (int y = low.y; y <= high.y; y += step) {
+			if (y < otherlow.y or y > otherhigh.y) {
+				for (int z = low.z; z <= high.z; z += step) {
+					func(ivec3(x,y,z));
+				}
+				continue;
+			}
+			range_difference(low.z, high.z, otherlow.z, otherhigh.z, step, [&] (int z) {
+				func(ivec3(x,y,z));
+			});
 		}
 	}
-	
-
-	return newChunks;
 }
 
 void SingleGame::loadOrGenerateTerrain(BlockContainer& bc) {
 		if (!filesystem->from_file(bc)) {
-			generator->generate_chunk(bc, 1);
+			gencache->generate_chunk(bc, TerrainGenerator::full_depth(bc.scale));
+			decorator->decorate_chunk(bc);
       filesystem->to_file(bc);
 		}
 }
 
 
+void SingleGame::add_chunk(Chunk&& chunk) {
+	ivec3 position = chunk.position;
+	std::lock_guard guard(chunkindex_lock);
+	ChunkStore::Handle handle = generatedWorld.add(std::move(chunk));
+	chunkindex.insert(position, handle.index);
+}
+
+Chunk SingleGame::remove_chunk(ChunkStore::Handle handle) {
+	std::unique_lock guard(chunkindex_lock);
+	Chunk* chunk = generatedWorld.get(handle);
+	chunkindex.erase(chunk->position);
+	// once it is out of the index it can't be pinned again, and the
+	// render jobs only keep their pins while rendering one chunk
+	chunk_unpinned.wait(guard, [&] () {
+		return !generatedWorld.pinned(handle);
+	});
+	Chunk removed (std::move(*chunk));
+	generatedWorld.remove(handle);
+	return removed;
+}
+
+
 void SingleGame::setup_gameloop() {
 	
 	cout << "starting test " << BDIMS << endl;
@@ -204,83 +560,381 @@ void SingleGame::setup_gameloop() {
   cout << getTime() - start << " Time iter (num blocks): " << num << endl;
   
 	spectator.controller = controls;
-	graphics->set_camera(&spectator.position, &spectator.angle);
+	snapshot.time = getTime();
+	snapshot.position = camera_position = spectator.position;
+	snapshot.angle = camera_angle = spectator.angle;
+	last_snapshot = snapshot;
+	graphics->set_camera(&camera_position, &camera_angle);
 	nick = std::thread(&SingleGame::threadRenderJob, this);
+	simthread = std::thread(&SingleGame::threadSimJob, this);
+
+}
 
+
+int SingleGame::update_streaming(const StreamGoal& goal) {
+	int radius = chunkloadingstart * worldsize;
+	
+	// the chunks outside of the cube that are closest to
+	// where the player is going, up to prefetch_chunks
+	vector<ivec3> newprefetch;
+	if (goal.prefetch_center != goal.center) {
+		cube_difference(goal.prefetch_center, goal.center, radius, worldsize, [&] (ivec3 pos) {
+			newprefetch.push_back(pos);
+		});
+		auto distance = [&] (ivec3 pos) {
+			ivec3 dist = (pos - goal.prefetch_center) / worldsize;
+			return dist.x*dist.x + dist.y*dist.y + dist.z*dist.z;
+		};
+		std::stable_sort(newprefetch.begin(), newprefetch.end(), [&] (ivec3 a, ivec3 b) {
+			return distance(a) < distance(b);
+		});
+		newprefetch.resize(std::min<int>(newprefetch.size(), prefetch_chunks));
+	}
+	ChunkIndex newprefetch_set;
+	for (ivec3 pos : newprefetch) {
+		newprefetch_set.insert(pos, 1);
+	}
+	
+	auto unload = [&] (ivec3 pos) {
+		if (in_stream_cube(pos, goal.center) or newprefetch_set.find(pos) != -1) {
+			return;
+		}
+		int index = chunkindex.find(pos);
+		if (index != -1) {
+			renderer->derender(*generatedWorld.at(index), graphics->blockbuf);
+			chunkcache->add(remove_chunk(generatedWorld.handle(index)));
+		}
+	};
+	if (streaming_started) {
+		cube_difference(stream_current.center, goal.center, radius, worldsize, unload);
+		for (ivec3 pos : prefetch_list) {
+			unload(pos);
+		}
+	}
+	
+	int queued = 0;
+	auto load = [&] (ivec3 pos) {
+		if (chunkindex.find(pos) == -1 and queued_chunks.find(pos) == -1) {
+			queued_chunks.insert(pos, 1);
+			load_queue.push_back({pos, getTime()});
+			queued ++;
+		}
+	};
+	// the first time the whole cube is new, so it is compared
+	// with a cube that is far enough away to not overlap it
+	ivec3 oldcenter = streaming_started ? stream_current.center : goal.center + radius * 4;
+	cube_difference(goal.center, oldcenter, radius, worldsize, load);
+	for (ivec3 pos : newprefetch) {
+		load(pos);
+	}
+	
+	stream_current = goal;
+	streaming_started = true;
+	prefetch_list.swap(newprefetch);
+	prefetch_set = std::move(newprefetch_set);
+	return queued;
 }
 
+void SingleGame::load_next_chunk() {
+	ivec3 pos;
+	double queuetime;
+	{
+		std::lock_guard lck(isChunkLoading_lock);
+		// chunks that are not wanted anymore are dropped
+		int numkept = 0;
+		for (const QueuedChunk& queued : load_queue) {
+			if (is_wanted(queued.position)) {
+				load_queue[numkept++] = queued;
+			} else {
+				queued_chunks.erase(queued.position);
+			}
+		}
+		load_queue.resize(numkept);
+		if (load_queue.empty()) {
+			return;
+		}
+		
+		// the closest to where the player is now, not when it was queued.
+		// Chunks in the direction the player is going count as up to half as far
+		auto distance = [&] (ivec3 chunkpos) {
+			vec3 dist = vec3(chunkpos - stream_current.center) / float(worldsize);
+			float length2 = glm::dot(dist, dist);
+			float ahead = length2 > 0 ? std::max(0.0f, glm::dot(dist, stream_current.ahead)) / std::sqrt(length2) : 0;
+			return length2 * (1 - 0.5f * ahead);
+		};
+		int closest = 0;
+		for (int i = 1; i < load_queue.size(); i ++) {
+			if (distance(load_queue[i].position) < distance(load_queue[closest].position)) {
+				closest = i;
+			}
+		}
+		pos = load_queue[closest].position;
+		queuetime = load_queue[closest].time;
+		load_queue[closest] = load_queue.back();
+		load_queue.pop_back();
+	}
+	
+	Chunk bc(this, pos, worldsize);
+	if (!chunkcache->take(pos, &bc)) {
+		loadOrGenerateTerrain(bc);
+	}
+	renderer->render(bc, graphics->blockbuf);
+	// before taking isChunkLoading_lock, which remove_chunk
+	// holds while it waits for the pins
+	bc.unpin_neighbors();
+	
+	std::lock_guard lck(isChunkLoading_lock);
+	queued_chunks.erase(pos);
+	if (is_wanted(pos)) {
+		add_chunk(std::move(bc));
+		load_times.push_back(getTime() - queuetime);
+	} else {
+		renderer->derender(bc, graphics->blockbuf);
+		chunkcache->add(std::move(bc));
+	}
+}
 
 void SingleGame::threadRenderJob() {
-	while(run_thread) {
-		vector<ivec3> chunksInRender;
+	int done_version = 0;
+	while (true) {
+		StreamGoal goal;
+		{
+			std::unique_lock guard(stream_lock);
+			stream_changed.wait(guard, [&] () {
+				return !run_thread or goal_version != done_version;
+			});
+			if (!run_thread) return;
+			goal = stream_goal;
+			done_version = goal_version;
+		}
+		
+		int queued;
 		{
 			std::lock_guard lck(isChunkLoading_lock);
-			chunksInRender = chunksInRenderDistance(spectator.position);
-
-			// Loop for derendering.
-			cout << generatedWorld.size() << endl;
-			for (int i = generatedWorld.size() - 1; i >= 0; i--) {
-				bool continueRendering = false;
-				for (int j = chunksInRender.size() - 1; j >= 0; j--) {
-					if (chunksInRender[j] == generatedWorld[i].position) {
-						continueRendering = true;
-						chunksInRender.erase(chunksInRender.begin() + j);
-						break;
-					}
-				}
-
-				if (!continueRendering) {
-					renderer->derender(generatedWorld[i], graphics->blockbuf);
-					generatedWorld.erase(generatedWorld.begin() + i);
-				}
+			queued = update_streaming(goal);
+		}
+		
+		// each job loads whichever chunk is closest when it starts
+		for (int i = 0; i < queued; i ++) {
+			if (multi_thread_loading_chunks) {
+				jobPool->pushJob([this] {
+					load_next_chunk();
+				});
+			} else {
+				load_next_chunk();
 			}
+		}
+	}
+}
 
-			// Loop for rendering and generating new chunks.
-			for (const ivec3& pos : chunksInRender) {
-				if (multi_thread_loading_chunks) {
-						jobPool->pushJob([pos, this] {
-							{
-								if (SingleGame::chunkStillValid(pos)) {
-									Chunk bc(this, pos, worldsize);
-									loadOrGenerateTerrain(bc);
-
-									renderer->render(bc, graphics->blockbuf);
-									std::lock_guard lck(isChunkLoading_lock);
-									generatedWorld.push_back(std::move(bc));
-								}
-							}
-						});
-				} else {
-					cout << pos << endl;
-					if (SingleGame::chunkStillValid(pos)) {
-						Chunk bc(this, pos, worldsize);
-						loadOrGenerateTerrain(bc);
-						renderer->render(bc, graphics->blockbuf);
-						generatedWorld.push_back(std::move(bc));
-					}
+void SingleGame::update_stream_goal() {
+	StreamGoal goal;
+	goal.center = player_chunk();
+	vec3 predicted = spectator.position + spectator.velocity * prefetch_seconds;
+	goal.prefetch_center = safefloor(predicted / float(worldsize)) * worldsize;
+	float speed = std::sqrt(glm::dot(spectator.velocity, spectator.velocity));
+	goal.ahead = speed > 0.01f ? spectator.velocity / speed : spectator.view_direction();
+	
+	std::lock_guard guard(stream_lock);
+	if (goal_version != 0 and goal.center != stream_goal.center) {
+		chunks_entered ++;
+		std::lock_guard indexguard(chunkindex_lock);
+		chunks_missed += chunkindex.find(goal.center) == -1;
+	}
+	if (goal_version == 0 or goal.center != stream_goal.center or goal.prefetch_center != stream_goal.prefetch_center) {
+		stream_goal = goal;
+		goal_version ++;
+		stream_changed.notify_one();
+	}
+}
+
+bool SingleGame::update_path(double deltatime) {
+	path_time += deltatime;
+	if (!replaying) {
+		if (record_path != "") {
+			path.record(path_time, spectator);
+		}
+		return false;
+	}
+	
+	{
+		std::lock_guard guard(isChunkLoading_lock);
+		queue_depths.push_back(load_queue.size());
+	}
+	{
+		std::lock_guard guard(jobPool->queue_mutex);
+		job_queue_depths.push_back(jobPool->job_queue.size());
+	}
+	if (!path.play(path_time, &spectator)) {
+		write_replay_stats();
+		sim_done = true;
+	}
+	return true;
+}
+
+// largest resident size of the process so far, or -1 if it is not known
+static int64 peak_memory_kb() {
+#ifdef _WIN32
+	return -1;
+#else
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+#ifdef __APPLE__
+	return usage.ru_maxrss / 1024;
+#else
+	return usage.ru_maxrss;
+#endif
+#endif
+}
+
+template <typename T>
+static void print_distribution(std::ostream& out, string name, vector<T> values) {
+	std::sort(values.begin(), values.end());
+	auto percentile = [&] (double amount) {
+		return values.empty() ? 0 : values[std::min<int>(values.size() - 1, values.size() * amount)];
+	};
+	double sum = 0;
+	for (T value : values) {
+		sum += value;
+	}
+	out << "  \"" << name << "\": {" << endl;
+	out << "    \"count\": " << values.size() << "," << endl;
+	out << "    \"mean\": " << (values.empty() ? 0 : sum / values.size()) << "," << endl;
+	out << "    \"p50\": " << percentile(0.5) << "," << endl;
+	out << "    \"p90\": " << percentile(0.9) << "," << endl;
+	out << "    \"p99\": " << percentile(0.99) << "," << endl;
+	out << "    \"max\": " << (values.empty() ? 0 : values.back()) << endl;
+	out << "  }," << endl;
+}
+
+void SingleGame::write_replay_stats() {
+	std::ofstream ofile;
+	if (replay_stats != "") {
+		ofile.open(replay_stats);
+	}
+	std::ostream& out = replay_stats != "" ? ofile : cout;
+	
+	vector<double> times;
+	{
+		std::lock_guard guard(isChunkLoading_lock);
+		times = load_times;
+	}
+	int64 entered, missed;
+	{
+		std::lock_guard guard(stream_lock);
+		entered = chunks_entered;
+		missed = chunks_missed;
+	}
+	vector<double> frames;
+	int64 late;
+	{
+		std::lock_guard guard(sim_lock);
+		frames = frame_times;
+		late = late_ticks;
+	}
+	
+	out << "{" << endl;
+	out << "  \"replay\": \"" << replay_path << "\"," << endl;
+	out << "  \"duration\": " << path.length() << "," << endl;
+	// seconds from a chunk being queued to it being rendered
+	print_distribution(out, "time_to_visible", times);
+	print_distribution(out, "frame_time", frames);
+	print_distribution(out, "queued_chunks", queue_depths);
+	print_distribution(out, "queued_jobs", job_queue_depths);
+	out << "  \"late_ticks\": " << late << "," << endl;
+	out << "  \"chunks_entered\": " << entered << "," << endl;
+	out << "  \"chunks_entered_before_loading\": " << missed << "," << endl;
+	out << "  \"peak_memory_kb\": " << peak_memory_kb() << endl;
+	out << "}" << endl;
+}
+
+void SingleGame::simulate(double deltatime) {
+	SpectatorInput input;
+	{
+		std::lock_guard guard(sim_lock);
+		input = pending_input;
+		// the turning is used once, the keys stay held
+		pending_input.turn = vec2(0,0);
+	}
+	spectator.move(input, deltatime);
+	update_path(deltatime);
+	update_stream_goal();
+}
+
+void SingleGame::threadSimJob() {
+	double deltatime = 1.0 / tick_rate;
+	auto ticklength = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(deltatime));
+	auto next_tick = std::chrono::steady_clock::now();
+	while (run_sim and !sim_done) {
+		if (realtime) {
+			next_tick += ticklength;
+			auto now = std::chrono::steady_clock::now();
+			if (now > next_tick) {
+				std::lock_guard guard(sim_lock);
+				late_ticks ++;
+				// more than a second behind is not made up, like the
+				// longest timestep that was allowed before
+				if (now - next_tick > std::chrono::seconds(1)) {
+					next_tick = now;
 				}
+			} else {
+				std::this_thread::sleep_until(next_tick);
 			}
 		}
-    if (!run_thread) return;
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000));
+		
+		simulate(deltatime);
+		sim_time += deltatime;
+		ticks ++;
+		
+		std::lock_guard guard(sim_lock);
+		last_snapshot = snapshot;
+		snapshot.time = getTime();
+		snapshot.position = spectator.position;
+		snapshot.angle = spectator.angle;
 	}
 }
 
+void SingleGame::update_camera(double time) {
+	std::lock_guard guard(sim_lock);
+	// the camera is one tick behind, so it is always between two ticks
+	float amount = std::min(std::max((time - snapshot.time) * tick_rate, 0.0), 1.0);
+	camera_position = last_snapshot.position + (snapshot.position - last_snapshot.position) * amount;
+	camera_angle = mix_angle(last_snapshot.angle, snapshot.angle, amount);
+}
+
 void SingleGame::timestep() {
 	static double last_time = getTime();
 	double cur_time = getTime();
-	double max_deltaTime = 1;
 	double deltatime = cur_time - last_time;
-
-	deltatime = std::min(max_deltaTime, deltatime);
 	last_time = cur_time;
 	
+	{
+		std::lock_guard guard(sim_lock);
+		pending_input.add(spectator.read_input());
+		if (replaying) {
+			frame_times.push_back(deltatime);
+		}
+	}
+	update_camera(cur_time);
+	
   std::stringstream debugstr;
   debugstr << "FPS: " << 1 / deltatime << endl;
-  debugstr << "spectatorpos: " << spectator.position << endl;
+  debugstr << "spectatorpos: " << camera_position << endl;
   
-	spectator.timestep(cur_time, deltatime);
 	graphics->viewbox->timestep(cur_time, deltatime);
+	
+	{
+		std::lock_guard guard(stream_lock);
+		debugstr << "chunks entered before loading: " << chunks_missed << "/" << chunks_entered << endl;
+	}
+	{
+		std::lock_guard guard(sim_lock);
+		debugstr << "late ticks: " << late_ticks << endl;
+	}
+	ChunkCacheStats cachestats = chunkcache->get_stats();
+	debugstr << "chunk cache: hits " << cachestats.hits << " packed " << cachestats.packed_hits
+		<< " misses " << cachestats.misses << " drops " << cachestats.drops
+		<< " kb " << cachestats.bytes / 1024 << " packed kb " << cachestats.packed_bytes / 1024 << endl;
 
   double start = getTime();
 	graphics->swap();
@@ -292,7 +946,7 @@ void SingleGame::timestep() {
   debuglines->clear();
   debuglines->draw(vec2(-0.99, 0.95), debugstr.str());
   
-  playing = !controls->key_pressed('Q');
+  playing = !controls->key_pressed('Q') and !sim_done;
 }
 
 
@@ -302,6 +956,15 @@ void SingleGame::timestep() {
 const int loading_resolution = worldsize/4;
 int PARAM(min_scale) = 1;
 int PARAM(detail_resolution) = 256;
+// blocks are full size within this distance of the player, and each band
+// after it reaches twice as far, with blocks twice as big
+int PARAM(lod_near) = 64;
+// detail is only lowered this fraction past the edge of a band, so
+// moving back and forth over the edge does not regenerate each time
+float PARAM(lod_margin) = 0.25f;
+// time the lod thread can spend each frame in milliseconds. The
+// node it is working on is always finished, even past the budget
+float PARAM(lod_budget_ms) = 4;
 
 
 SingleTreeGame::SingleTreeGame(): world(ivec3(-worldsize/2, -worldsize/2, -worldsize/2), worldsize) {
@@ -310,11 +973,23 @@ SingleTreeGame::SingleTreeGame(): world(ivec3(-worldsize/2, -worldsize/2, -world
 	renderer = Renderer::plugnew();
 	controls = Controls::plugnew();
 	generator = TerrainGenerator::plugnew(12345);
+	gencache = new GenerationCache("world/gencache/", generator);
+	decorator = TerrainDecorator::plugnew(generator);
 	threadpool = new Pool(4);
 }
 
 SingleTreeGame::~SingleTreeGame() {
+	{
+		std::lock_guard guard(frame_lock);
+		run_lod = false;
+	}
+	frame_changed.notify_one();
+	if (lodthread.joinable()) {
+		lodthread.join();
+	}
 	delete threadpool;
+	delete gencache;
+	plugdelete(decorator);
 	plugdelete(generator);
 	plugdelete(controls);
 	plugdelete(renderer);
@@ -340,6 +1015,7 @@ void SingleTreeGame::setup_gameloop() {
 	world.split();
 	// NodeView nodearr[8];
 	threadpool->pushJob([this]() {
+		std::lock_guard guard(generation_lock);
 		double start = getTime();
 		for (int i = 0; i < BDIMS3; i ++) {
 			world.child(i).set_flag(Block::GENERATION_FLAG);
@@ -447,8 +1123,15 @@ void SingleTreeGame::setup_gameloop() {
 		HitBox box2 (vec3(1,1,1), vec3(1,1,1));
 
 		cout << box1 << ' ' << box2 << ' ' << box1.collides(box2) << endl;
+		
+		{
+			std::lock_guard frameguard(frame_lock);
+			first_world_done = true;
+		}
+		frame_changed.notify_one();
 	});
-  
+	
+	lodthread = std::thread(&SingleTreeGame::threadLodJob, this);
 }
 
 void SingleTreeGame::join_chunk(NodeView node, int depth) {
@@ -471,12 +1154,25 @@ void SingleTreeGame::join_chunk(NodeView node, int depth) {
 
 void SingleTreeGame::update_chunk(NodeView node, int depth) {
 	// cout << node.position << ' ' << node.scale << endl;
-	if (depth > node.max_depth() and node.test_flag(Block::GENERATION_FLAG)) {
+	bool empty = !node.haschildren() and !node.hasblock();
+	if ((depth > node.max_depth() or empty) and node.test_flag(Block::GENERATION_FLAG)) {
 		// cout << "generating " << depth << ' ' << node.max_depth() << ' ' << node.hasblock() << ' ' << node.test_flag(Block::GENERATION_FLAG) << endl;
-		for (NodePtr delnode : NodePtr(node).iter<FlagBlockIter>(Block::GENERATION_FLAG)) {
-			renderer->derender(delnode, graphics->blockbuf);
+		// the node is generated again from nothing, so the detail it
+		// already has is removed (see TerrainGenerator::generate_chunk)
+		renderer->derender(node, graphics->blockbuf);
+		if (node.haschildren()) {
+			node.join();
+		}
+		// generators that stop early at depth flag the nodes they
+		// stopped at again, the others generate everything
+		node.reset_flag(Block::GENERATION_FLAG);
+		gencache->generate_chunk(node, depth);
+		// structures are only seen up close, and decorating far nodes
+		// would split them down to single blocks just to be joined again.
+		// The node is decorated when it is generated again in full detail
+		if (TerrainGenerator::depth_scale(node.scale, depth) == 1) {
+			decorator->decorate_chunk(node);
 		}
-		generator->generate_chunk(node, depth);
 		// cout << " " << depth << ' ' << node.max_depth() << ' ' << node.hasblock() << ' ' << node.test_flag(Block::GENERATION_FLAG) << endl;
 	}
 	if (depth < node.max_depth()) {
@@ -538,97 +1234,187 @@ void SingleTreeGame::generate_first_world(NodeView* nodearr) {
 }
 
 
-void SingleTreeGame::generate_new_world(NodeView newnode, NodeView oldroot, bool generate, bool copy) {
-	// cout << newnode.position << ' ' << oldroot.position << ' ' <<(newnode.position - oldroot.position) % newnode.scale  << endl;
-	if ((newnode.position - oldroot.position) % newnode.scale != ivec3(0,0,0)) {
-		if (!newnode.haschildren()) {
-			newnode.split();
-		}
-		for (int i = 0; i < BDIMS3; i ++) {
-			generate_new_world(newnode.child(i), oldroot, generate, copy);
-		}
-	} else if (oldroot.contains(newnode)) {
-		if (copy) {
-			NodeView src = oldroot.get_global(newnode.position, newnode.scale);
-			if (src.scale > newnode.scale) {
-				// cout << "copying " << newnode.position << ' ' << newnode.scale << " from " << src.position << ' ' << src.scale << endl;
-				newnode.copy_tree(src);
-			} else {
-				// cout << "swapping " << newnode.position << ' ' << newnode.scale << endl;
-				newnode.swap_tree(src);
-			}
-			for (Direction dir : Direction::all) {
-				IHitCube sidebox = IHitCube(newnode) + ivec3(dir);
-				if (!sidebox.collides(oldroot)) {
-					NodeView sidenode = newnode.get_global(sidebox.position, sidebox.scale);
-					if (sidenode.isvalid()) {
-						for (NodePtr node : NodePtr(sidenode).iter<DirBlockIter>(-dir)) {
-							node.on_change();
-						}
-						for (NodePtr node : NodePtr(newnode).iter<DirBlockIter>(dir)) {
-							node.on_change();
-						}
-					}
-				}
-			}
-		}
-	} else {
-		if (generate) {
-			// cout << "generating " << newnode.position << ' ' << newnode.scale << endl;
-			generator->generate_chunk(newnode, 10000);
-		}
-	}
-}
-
-void SingleTreeGame::check_loading() {
-	if (generation_lock.try_lock()) {
-		std::unique_lock guard(generation_lock, std::adopt_lock);
-		// IHitCube detailgoalbox (detail_center - detail_resolution*3/4, detail_resolution*3/2);
-		// if (!detailgoalbox.contains(ivec3(spectator.position))) {
-		//   ivec3 localpos = ivec3(spectator.position) - detail_center;
-		//   ivec3 rolldir = glm::sign(localpos * 2 / detail_resolution);
-		//   detail_center += rolldir * detail_resolution;
-		// threadpool->pushJob([this] () {
-		//for (int i = 0; i < BDIMS3; i ++) {
-		//  generate_first_world_recurse(world.child(i));
-		//}
-		//renderer->render(world, graphics->blockbuf);
-		// });
-		// }
-		//return;
-		IHitCube goalbox (world.midpoint() - loading_resolution*3/4, loading_resolution*3/2);
-		if (!goalbox.contains(ivec3(spectator.position))) {
-			ivec3 localpos = ivec3(spectator.position) - goalbox.midpoint();
-			ivec3 rolldir = glm::sign(localpos * 2 / loading_resolution);
-			ivec3 newpos = world.position + rolldir * loading_resolution;
-			// relocate_world(newpos);
-			threadpool->pushJob([this, newpos] () {
-					relocate_world(newpos);
-					});
+void SingleTreeGame::check_loading(vec3 center) {
+	IHitCube goalbox (world.midpoint() - loading_resolution*3/4, loading_resolution*3/2);
+	if (!goalbox.contains(ivec3(center))) {
+		ivec3 localpos = ivec3(center) - goalbox.midpoint();
+		ivec3 rolldir = glm::sign(localpos * 2 / loading_resolution);
+		relocate_world(world.position + rolldir * loading_resolution);
+	}
+}
+
+NodeView SingleTreeGame::world_node(ivec3 pos, int scale) {
+	NodeView node = world;
+	while (node.scale > scale) {
+		if (!node.haschildren()) {
+			bool generated = node.test_flag(Block::GENERATION_FLAG);
+			// the copies of the block in the children are rendered again
+			renderer->derender(node, graphics->blockbuf);
+			node.subdivide();
+			node.set_all_flags(Block::RENDER_FLAG | (generated ? Block::GENERATION_FLAG : 0));
 		}
+		node = node.child(NodeIndex((pos - node.position) / (node.scale / BDIMS)));
 	}
+	return node;
+}
+
+NodeView SingleTreeGame::world_cell(ivec3 cell) {
+	return world_node(world.position + cell * loading_resolution, loading_resolution);
 }
 
 void SingleTreeGame::relocate_world(ivec3 newpos) {
 	std::lock_guard guard(generation_lock);
 
 	cout << "Changing from " << world.position << " to " << newpos << endl;
-	BlockContainer newworld (newpos, world.scale);
+	double start = getTime();
+	
+	// the cells keep their place in the world, so moving the root by shift cells
+	// moves every cell by -shift in the root. This is done in place by following
+	// the cycles of the permutation, where the cells that fall off one side wrap
+	// around to the other, and are then cleared for the cells that enter
+	int cells = world.scale / loading_resolution;
+	ivec3 shift = (newpos - world.position) / loading_resolution;
+	auto wrap = [&] (ivec3 cell) {
+		return ((cell % cells) + cells) % cells;
+	};
+	auto in_world = [&] (ivec3 cell) {
+		return cell.x >= 0 and cell.y >= 0 and cell.z >= 0
+			and cell.x < cells and cell.y < cells and cell.z < cells;
+	};
+	
+	vector<bool> moved (cells * cells * cells, false);
+	auto cell_index = [&] (ivec3 cell) {
+		return (cell.x * cells + cell.y) * cells + cell.z;
+	};
+	for (int x = 0; x < cells; x ++) {
+		for (int y = 0; y < cells; y ++) {
+			for (int z = 0; z < cells; z ++) {
+				ivec3 start (x,y,z);
+				if (moved[cell_index(start)]) continue;
+				moved[cell_index(start)] = true;
+				// after each swap cell holds the tree that belongs there
+				ivec3 cell = start;
+				for (ivec3 next = wrap(cell + shift); next != start; next = wrap(next + shift)) {
+					world_cell(cell).swap_tree(world_cell(next));
+					cell = next;
+					moved[cell_index(cell)] = true;
+				}
+			}
+		}
+	}
+	world.position = newpos;
+	
+	// the lod thread generates the new cells
+	int newcells = 0;
+	for (int x = 0; x < cells; x ++) {
+		for (int y = 0; y < cells; y ++) {
+			for (int z = 0; z < cells; z ++) {
+				if (!in_world(ivec3(x,y,z) + shift)) {
+					NodeView node = world_cell(ivec3(x,y,z));
+					renderer->derender(node, graphics->blockbuf);
+					node.join();
+					node.set_flag(Block::GENERATION_FLAG);
+					newcells ++;
+				}
+			}
+		}
+	}
+	
+	cout << "relocated " << newcells << " of " << cells * cells * cells << " cells in " << getTime() - start << endl;
+}
 
-	cout << "generating new world" << endl;
-	generate_new_world(newworld, world, true, false);
-	renderer->render(newworld, graphics->blockbuf);
+int SingleTreeGame::lod_depth(int scale, float distance) {
+	int band = 0;
+	for (float edge = lod_near; distance >= edge and band < 24; edge *= 2) {
+		band ++;
+	}
+	int blocksize = min_scale << band;
+	int depth = 0;
+	for (int size = scale; size > blocksize; size /= BDIMS) {
+		depth ++;
+	}
+	return depth;
+}
 
-	{
-		std::lock_guard guard(world_lock);
-		cout << "copying old world over" << endl;
-		generate_new_world(newworld, world, false, true);
-		newworld.swap(world);
+void SingleTreeGame::update_lod(vec3 center) {
+	std::lock_guard guard(generation_lock);
+	check_loading(center);
+	
+	struct LodJob {
+		ivec3 position;
+		int depth;
+		float priority;
+	};
+	
+	// detail is changed in nodes of this size, which are inside one cell
+	int unitsize = std::min(detail_resolution, loading_resolution);
+	int units = world.scale / unitsize;
+	vector<LodJob> jobs;
+	for (int x = 0; x < units; x ++) {
+		for (int y = 0; y < units; y ++) {
+			for (int z = 0; z < units; z ++) {
+				NodeView node = world_node(world.position + ivec3(x,y,z) * unitsize, unitsize);
+				vec3 offset = vec3(0,0,0);
+				for (int axis = 0; axis < 3; axis ++) {
+					offset[axis] = std::max(std::max(node.position[axis] - center[axis], center[axis] - (node.position[axis] + node.scale)), 0.0f);
+				}
+				float distance = std::sqrt(glm::dot(offset, offset));
+				int depth = lod_depth(node.scale, distance);
+				bool empty = !node.haschildren() and !node.hasblock();
+				bool generated = node.test_flag(Block::GENERATION_FLAG);
+				if ((depth > node.max_depth() or empty) and generated) {
+					jobs.push_back({node.position, depth, distance});
+				} else if (lod_depth(node.scale, distance / (1 + lod_margin)) < node.max_depth()) {
+					// lowering detail only saves memory, so it is done after the
+					// nodes that need more detail
+					jobs.push_back({node.position, depth, distance + world.scale * 2});
+				}
+			}
+		}
+	}
+	std::sort(jobs.begin(), jobs.end(), [] (const LodJob& a, const LodJob& b) {
+		return a.priority < b.priority;
+	});
+	
+	double start = getTime();
+	int done = 0;
+	// at least one node is done each frame, so a small budget is still making progress
+	while (done < jobs.size() and (done == 0 or getTime() - start < lod_budget_ms / 1000)) {
+		NodeView node = world_node(jobs[done].position, unitsize);
+		update_chunk(node, jobs[done].depth);
+		// the faces next to it have to be found again
+		for (Direction dir : Direction::all) {
+			NodeView sidenode = world.get_global(node.position + ivec3(dir) * node.scale, node.scale);
+			if (sidenode.isvalid()) {
+				for (NodePtr sideblock : NodePtr(sidenode).iter<DirBlockIter>(-dir)) {
+					sideblock.on_change();
+				}
+			}
+		}
+		done ++;
 	}
-	renderer->render(world, graphics->blockbuf);
+	lod_pending = jobs.size() - done;
+	
+	if (done > 0) {
+		renderer->render(world, graphics->blockbuf);
+	}
+}
 
-	cout << "derendering " << endl;
-	renderer->derender(newworld, graphics->blockbuf);
+void SingleTreeGame::threadLodJob() {
+	int done_version = 0;
+	while (true) {
+		vec3 center;
+		{
+			std::unique_lock guard(frame_lock);
+			frame_changed.wait(guard, [&] () {
+				return !run_lod or (first_world_done and frame_version != done_version);
+			});
+			if (!run_lod) return;
+			center = lod_center;
+			done_version = frame_version;
+		}
+		update_lod(center);
+	}
 }
 
 void SingleTreeGame::timestep() {
@@ -636,10 +1422,16 @@ void SingleTreeGame::timestep() {
 	double cur_time = getTime();
 	double deltatime = cur_time - last_time;
 	last_time = cur_time;
-	//check_loading();
+	{
+		std::lock_guard guard(frame_lock);
+		lod_center = spectator.position;
+		frame_version ++;
+	}
+	frame_changed.notify_one();
 	std::stringstream debugstr;
 	debugstr << "FPS: " << 1 / deltatime << endl;
 	debugstr << "spectatorpos: " << spectator.position << endl;
+	debugstr << "lod nodes waiting: " << lod_pending << endl;
 	debuglines->clear();
 	debuglines->draw(vec2(-0.99, 0.95), debugstr.str());
 
@@ -9,7 +9,39 @@
 
 #include <thread>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
+#include <optional>
+#include <memory>
+#include <list>
+#include <map>
+#include <tuple>
+
+// Finds the index of a chunk from its position. Uses open addressing with
+// linear probing, so a lookup is usually one or two slots of one array
+class ChunkIndex {
+public:
+	ChunkIndex(int capacity = 64);
+	
+	// -1 if there is no chunk at the position
+	int find(ivec3 pos) const;
+	// replaces the index if the position is already there
+	void insert(ivec3 pos, int index);
+	void erase(ivec3 pos);
+	int size() const;
+	
+private:
+	struct Slot {
+		ivec3 position;
+		// -1 for an empty slot
+		int index = -1;
+	};
+	vector<Slot> slots;
+	int count = 0;
+	
+	int home(ivec3 pos) const;
+	void grow();
+};
 
 class Chunk : public BlockContainer {
 public:
@@ -17,7 +49,129 @@ public:
 	
 	Chunk(SingleGame* newgame, ivec3 pos, int scale);
 	
+	// pins the neighbor it returns, so it is not removed while it is read
 	virtual BlockContainer* find_neighbor(ivec3 pos, int goalscale);
+	// called when done reading the neighbors, after rendering
+	void unpin_neighbors();
+	
+private:
+	// the slots of the neighbors that are pinned
+	vector<int> pinned;
+};
+
+// Holds the loaded chunks in pages that are never moved, so a chunk keeps
+// its address for as long as it is loaded. Handles to a chunk stop working
+// when it is removed, even if its slot is used by another chunk later.
+// A chunk that is pinned is being read by another thread, and the
+// caller has to wait until it is unpinned before removing it
+class ChunkStore {
+public:
+	struct Handle {
+		int index = -1;
+		uint32 generation = 0;
+	};
+	
+	static constexpr int page_size = 64;
+	static constexpr int max_pages = 1024;
+	
+	ChunkStore() = default;
+	ChunkStore(const ChunkStore& other) = delete;
+	ChunkStore& operator=(const ChunkStore& other) = delete;
+	
+	// moves the chunk into a free slot
+	Handle add(Chunk&& chunk);
+	void remove(Handle handle);
+	// nullptr if the chunk was removed
+	Chunk* get(Handle handle);
+	// the chunk in the slot, or nullptr if it is empty
+	Chunk* at(int index);
+	Handle handle(int index);
+	int size() const;
+	
+	void pin(int index);
+	void unpin(int index);
+	bool pinned(Handle handle);
+	
+	class iterator {
+	public:
+		iterator(ChunkStore* store, int index);
+		Chunk& operator*() const;
+		iterator& operator++();
+		bool operator!=(const iterator& other) const;
+		Handle handle() const;
+	private:
+		ChunkStore* store;
+		int index;
+	};
+	
+	iterator begin();
+	iterator end();
+	
+private:
+	struct Slot {
+		uint32 generation = 0;
+		int pins = 0;
+		std::optional<Chunk> chunk;
+	};
+	struct Page {
+		Slot slots[page_size];
+	};
+	
+	// a fixed table, so adding a page never moves the others
+	std::unique_ptr<Page> pages[max_pages];
+	int num_slots = 0;
+	int count = 0;
+	vector<int> freeslots;
+	
+	Slot& slot(int index);
+};
+
+// counts of how well the chunk cache works
+struct ChunkCacheStats {
+	int64 hits = 0;
+	int64 packed_hits = 0;
+	int64 misses = 0;
+	// chunks dropped to make space
+	int64 drops = 0;
+	int64 bytes = 0;
+	int64 packed_bytes = 0;
+};
+
+// Chunks that were unloaded recently, so moving back to them does not read or
+// generate them again. Up to chunk_cache_kb of chunks are kept as they are,
+// then the least recently used ones are kept in the file format, which is much
+// smaller, up to chunk_cache_packed_kb. After that they are dropped, as every
+// chunk is saved to its file when it is generated, and is not changed after
+class ChunkCache {
+public:
+	
+	// takes the chunk, which was unloaded
+	void add(Chunk&& chunk);
+	// moves the cached chunk at the position into chunk,
+	// returns false if it is not cached
+	bool take(ivec3 position, Chunk* chunk);
+	ChunkCacheStats get_stats();
+	
+private:
+	struct Entry {
+		ivec3 position;
+		int scale;
+		int64 bytes;
+		// one of these is used, depending on the list it is in
+		std::optional<Chunk> chunk;
+		string packed;
+	};
+	using ChunkKey = std::tuple<int,int,int>;
+	
+	std::mutex lock;
+	// most recently used first
+	std::list<Entry> chunks;
+	std::list<Entry> packed;
+	std::map<ChunkKey,std::list<Entry>::iterator> index;
+	ChunkCacheStats stats;
+	
+	static ChunkKey key(ivec3 position);
+	void shrink();
 };
 
 // Game is the main class that runs the whole game
@@ -52,18 +206,137 @@ protected:
 	BlockFileSystem* filesystem;
 	
 	TerrainGenerator* generator;
+	GenerationCache* gencache;
+	TerrainDecorator* decorator;
+
+	// chunks are added and removed under isChunkLoading_lock. The
+	// render jobs read the chunks next to the one they render without it,
+	// so those are pinned and remove_chunk waits until they are unpinned
+	ChunkStore generatedWorld;
+	// the slot of each chunk in generatedWorld. It is changed with
+	// generatedWorld, and also has its own lock for find_neighbor,
+	// which is called while rendering. The pins are changed under it too
+	ChunkIndex chunkindex;
+	std::mutex chunkindex_lock;
+	std::condition_variable chunk_unpinned;
+	// chunks that were unloaded, to load again quickly
+	ChunkCache* chunkcache;
 
-	// Allocate on the heap because we want to change render distance.
-	vector<Chunk> generatedWorld;
+	// The chunks in a cube around the chunk the player is in are loaded,
+	// and some of the chunks around where the player is going to be.
+	// timestep sets the goal when either of these moves to another chunk,
+	// and the streaming thread then only changes the chunks that enter or
+	// leave the cube
+	struct StreamGoal {
+		// chunk the player is in
+		ivec3 center;
+		// chunk the player will be in after prefetch_seconds
+		ivec3 prefetch_center;
+		// direction the player is moving, or looking if it is not
+		// moving. Chunks in this direction are loaded first
+		vec3 ahead;
+	};
+	// these are under stream_lock
+	std::mutex stream_lock;
+	std::condition_variable stream_changed;
+	StreamGoal stream_goal;
+	int goal_version = 0;
+	// chunks the player moved into, and how many of them were not loaded yet
+	int64 chunks_entered = 0;
+	int64 chunks_missed = 0;
+	
+	// these are under isChunkLoading_lock
+	StreamGoal stream_current;
+	bool streaming_started = false;
+	struct QueuedChunk {
+		ivec3 position;
+		// when it was queued
+		double time;
+	};
+	// chunks waiting to be loaded, the closest one is loaded first
+	vector<QueuedChunk> load_queue;
+	// chunks that are in load_queue or being loaded
+	ChunkIndex queued_chunks;
+	// chunks outside of the cube that are loaded ahead of the player
+	vector<ivec3> prefetch_list;
+	ChunkIndex prefetch_set;
 
+	// seconds from each chunk being queued to it being rendered and
+	// added, for the replay stats. Under isChunkLoading_lock
+	vector<double> load_times;
+	
 	Spectator spectator;
 	Controls* controls;
 	std::thread nick;
 	std::atomic<bool> run_thread = true;
+	
+	// the spectator's movement, saved to record_path or played back from replay_path
+	SpectatorPath path;
+	bool replaying = false;
+	double path_time = 0;
+	// measured each tick of a replay
+	vector<int> queue_depths;
+	vector<int> job_queue_depths;
+	
+	// The spectator and streaming are simulated on simthread at a fixed
+	// tick rate. The render thread only reads the controls and draws,
+	// moving the camera between the last two ticks so it stays smooth
+	struct SimSnapshot {
+		double time = 0;
+		vec3 position = vec3(0,0,0);
+		vec2 angle = vec2(0,0);
+	};
+	std::thread simthread;
+	std::atomic<bool> run_sim = true;
+	// set when the simulation ends the game, like at the end of a replay
+	std::atomic<bool> sim_done = false;
+	int tick_rate;
+	// false runs the ticks as fast as possible instead of waiting for each one
+	bool realtime = true;
+	// these are only used by simthread
+	double sim_time = 0;
+	int64 ticks = 0;
+	// these are under sim_lock
+	std::mutex sim_lock;
+	SimSnapshot last_snapshot;
+	SimSnapshot snapshot;
+	SpectatorInput pending_input;
+	// ticks that started after they should have finished
+	int64 late_ticks = 0;
+	// measured each frame of a replay
+	vector<double> frame_times;
+	// the camera, only used by the render thread
+	vec3 camera_position;
+	vec2 camera_angle;
 
 	void loadOrGenerateTerrain(BlockContainer& bc);
+	// both need isChunkLoading_lock to be held
+	void add_chunk(Chunk&& chunk);
+	// returns the removed chunk, so it can be cached
+	Chunk remove_chunk(ChunkStore::Handle handle);
 	void threadRenderJob();
-	bool chunkStillValid(vec3 chunkPos);
+	
+	ivec3 player_chunk();
+	bool in_stream_cube(ivec3 chunkpos, ivec3 center);
+	// whether the chunk should be loaded for stream_current
+	bool is_wanted(ivec3 chunkpos);
+	// moves to the new goal, returning the number of chunks queued
+	int update_streaming(const StreamGoal& goal);
+	// loads the closest chunk in load_queue
+	void load_next_chunk();
+	// tells the streaming thread where the spectator is
+	void update_stream_goal();
+	// records or plays back the spectator for the tick. Returns true if it
+	// was moved by the replay, and stops the game when the replay ends
+	bool update_path(double deltatime);
+	// writes the measurements of the replay as json
+	void write_replay_stats();
+	// one tick of the simulation, run on simthread
+	virtual void simulate(double deltatime);
+	void threadSimJob();
+	// moves the camera to where the spectator is at the time,
+	// between the last two snapshots
+	void update_camera(double time);
 	
 	friend class Chunk;
 };
@@ -79,23 +352,52 @@ public:
 	void update_chunk(NodeView root, int depth);
 	void generate_first_world(NodeView* nodearr);
 	void generate_first_world_recurse(NodeView node);
-	void generate_new_world(NodeView newnode, NodeView oldroot, bool generate, bool copy);
-	void check_loading();
+	// moves the world if center is too far from its middle
+	void check_loading(vec3 center);
+	// the node at the position and scale in the world,
+	// splitting the nodes above it if needed
+	NodeView world_node(ivec3 pos, int scale);
+	// the node of scale loading_resolution at the cell index in the world
+	NodeView world_cell(ivec3 cell);
+	// moves the world by a multiple of loading_resolution. The cells that stay
+	// are moved in the tree without copying, and only the new ones are generated
 	void relocate_world(ivec3 newpos);
+	// the depth a node should be generated to at the distance from the player
+	int lod_depth(int scale, float distance);
+	// changes the detail of the nodes that are in the wrong distance band,
+	// closest first, until the time budget for the frame is used
+	void update_lod(vec3 center);
+	void threadLodJob();
 	virtual void setup_gameloop();
 	virtual void timestep();
 protected:
 	GraphicsContext* graphics;
 	Renderer* renderer;
 	TerrainGenerator* generator;
+	GenerationCache* gencache;
+	TerrainDecorator* decorator;
 	Pool* threadpool;
 	int fixed_depth = 0;
 	ivec3 detail_center = ivec3(0,0,0);
 	
+	// the world is only changed by the job that generates the first
+	// world and then by the lod thread, under generation_lock
 	std::mutex generation_lock;
-	std::mutex world_lock;
 	BlockContainer world;
 	
+	// the lod thread does one batch of work for each frame
+	std::thread lodthread;
+	std::atomic<bool> run_lod = true;
+	// these are under frame_lock
+	std::mutex frame_lock;
+	std::condition_variable frame_changed;
+	int frame_version = 0;
+	vec3 lod_center;
+	// the lod thread starts once the first world is generated
+	bool first_world_done = false;
+	// nodes that still need their detail changed
+	std::atomic<int> lod_pending = 0;
+	
 	Spectator spectator;
 	// Player* player;
 	Controls* controls;
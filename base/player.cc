@@ -1,15 +1,38 @@
 #include "player.h"
 
+#include <algorithm>
+#include <fstream>
+
 DEFINE_PLUGIN(Controls);
 
 float mouseSpeed = 0.003f;
 
 void Spectator::timestep(float curtime, float deltatime) {
 	if (controller == nullptr) return;
+	move(read_input(), deltatime);
+}
+
+SpectatorInput Spectator::read_input() {
+	SpectatorInput input;
+	if (controller == nullptr) return input;
 	
 	ivec2 screen_dims (100,100);
 	
-	angle += vec2(float(mouseSpeed) * vec2(screen_dims/2 - controller->mouse_pos()));
+	input.turn = float(mouseSpeed) * vec2(screen_dims/2 - controller->mouse_pos());
+	// Reset mouse position for next frame
+	controller->mouse_pos(screen_dims/2);
+	
+	input.fast = controller->key_pressed(controller->KEY_CTRL);
+	input.move.z = int(controller->key_pressed('W')) - int(controller->key_pressed('S'));
+	input.move.x = int(controller->key_pressed('D')) - int(controller->key_pressed('A'));
+	input.move.y = int(controller->key_pressed(' ')) - int(controller->key_pressed(controller->KEY_SHIFT));
+	return input;
+}
+
+void Spectator::move(const SpectatorInput& input, float deltatime) {
+	vec3 oldposition = position;
+	
+	angle += input.turn;
 	
 	//cout << horizontalAngle << ' ' << verticalAngle << endl;
 	if (angle.y > 1.55f) {
@@ -25,10 +48,7 @@ void Spectator::timestep(float curtime, float deltatime) {
 		angle.x = 6.28;
 	}
 	
-	// Reset mouse position for next frame
-	controller->mouse_pos(screen_dims/2);
-	
-	float nspeed = 8;
+	float nspeed = input.fast ? 64 : 8;
 	
 	glm::vec3 right = glm::vec3(
 		sin(angle.x - 3.14f/2.0f),
@@ -44,34 +64,91 @@ void Spectator::timestep(float curtime, float deltatime) {
 	// Up vector
 	glm::vec3 up = glm::cross( right, forward );
 	
+	position += forward * deltatime * nspeed * float(input.move.z);
+	position += right * deltatime * nspeed * float(input.move.x);
+	position += up * deltatime * nspeed * float(input.move.y);
+	
+	velocity = deltatime > 0 ? (position - oldposition) / deltatime : vec3(0,0,0);
+}
 
-	if(controller->key_pressed(controller->KEY_CTRL)) {
-		nspeed = 64;
-	} else {
-		nspeed = 8;
-	}
+vec3 Spectator::view_direction() const {
+	// the same direction the camera is given by the graphics context
+	return vec3(
+		cos(angle.y) * sin(angle.x),
+		sin(angle.y),
+		cos(angle.y) * cos(angle.x)
+	);
+}
 
-	if (controller->key_pressed('W')){
-		position += forward * deltatime * nspeed;
-	}
-	// Move backward
-	if (controller->key_pressed('S')){
-		position -= forward * deltatime * nspeed;
+
+
+void SpectatorPath::record(double time, const Spectator& spectator) {
+	frames.push_back({time, spectator.position, spectator.angle});
+}
+
+bool SpectatorPath::play(double time, Spectator* spectator) const {
+	if (frames.empty() or time > frames.back().time) {
+		return false;
 	}
-	// Strafe right
-	if (controller->key_pressed('D')){
-		position += right * deltatime * nspeed;
+	// the first frame after the time
+	auto after = std::upper_bound(frames.begin(), frames.end(), time, [] (double time, const Frame& frame) {
+		return time < frame.time;
+	});
+	if (after == frames.begin() or after == frames.end()) {
+		const Frame& frame = after == frames.end() ? frames.back() : frames.front();
+		spectator->position = frame.position;
+		spectator->angle = frame.angle;
+		spectator->velocity = vec3(0,0,0);
+		return true;
 	}
-	// Strafe left
-	if (controller->key_pressed('A')){
-		position -= right * deltatime * nspeed;
+	
+	const Frame& next = *after;
+	const Frame& prev = *(after - 1);
+	double length = next.time - prev.time;
+	float amount = length > 0 ? (time - prev.time) / length : 1;
+	
+	spectator->position = prev.position + (next.position - prev.position) * amount;
+	spectator->angle = mix_angle(prev.angle, next.angle, amount);
+	spectator->velocity = length > 0 ? (next.position - prev.position) / float(length) : vec3(0,0,0);
+	return true;
+}
+
+vec2 mix_angle(vec2 a, vec2 b, float amount) {
+	vec2 turn = b - a;
+	if (turn.x > 3.14f) turn.x -= 6.28f;
+	if (turn.x < -3.14f) turn.x += 6.28f;
+	return a + turn * amount;
+}
+
+void SpectatorInput::add(const SpectatorInput& newer) {
+	turn += newer.turn;
+	move = newer.move;
+	fast = newer.fast;
+}
+
+double SpectatorPath::length() const {
+	return frames.empty() ? 0 : frames.back().time;
+}
+
+bool SpectatorPath::to_file(string path) const {
+	std::ofstream ofile (path);
+	ofile.precision(9);
+	for (const Frame& frame : frames) {
+		ofile << frame.time << ' ' << frame.position.x << ' ' << frame.position.y << ' ' << frame.position.z
+			<< ' ' << frame.angle.x << ' ' << frame.angle.y << endl;
 	}
-	if (controller->key_pressed(' ')){
-		position += up * deltatime * nspeed;
+	return ofile.good();
+}
+
+bool SpectatorPath::from_file(string path) {
+	std::ifstream ifile (path);
+	if (!ifile.good()) {
+		return false;
 	}
-	if (controller->key_pressed(controller->KEY_SHIFT)){
-		position -= up * deltatime * nspeed;
+	frames.clear();
+	Frame frame;
+	while (ifile >> frame.time >> frame.position.x >> frame.position.y >> frame.position.z >> frame.angle.x >> frame.angle.y) {
+		frames.push_back(frame);
 	}
-
-
+	return true;
 }
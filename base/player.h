@@ -22,14 +22,60 @@ class Controls { public:
 	virtual int scroll_rel() = 0;
 };
 
+// what the controls asked a spectator to do
+struct SpectatorInput {
+	// change in angle from moving the mouse
+	vec2 turn = vec2(0,0);
+	// keys held down along each axis, -1, 0 or 1:
+	// x is right, y is up and z is forward
+	ivec3 move = ivec3(0,0,0);
+	bool fast = false;
+	
+	// the turning of both, with the keys of the newer one
+	void add(const SpectatorInput& newer);
+};
+
 // simple player class, has no physics and
 // flies around
 class Spectator { public:
 	vec3 position = vec3(0,0,0);
 	vec2 angle = vec2(0,0);
+	// movement in the last timestep, in blocks per second
+	vec3 velocity = vec3(0,0,0);
 	Controls* controller = nullptr;
 	
 	void timestep(float curtime, float deltatime);
+	// reads the controller, which can be done on a different thread than
+	// move. The mouse is put back in the middle after it is read
+	SpectatorInput read_input();
+	void move(const SpectatorInput& input, float deltatime);
+	// unit vector the camera looks along
+	vec3 view_direction() const;
+};
+
+// mixes the angles a and b, going the short way around
+// where the horizontal angle wraps from 6.28 to 0
+vec2 mix_angle(vec2 a, vec2 b, float amount);
+
+// the movement of a spectator, which can be saved and played back
+// later, so that different runs see exactly the same movement
+class SpectatorPath { public:
+	struct Frame {
+		double time;
+		vec3 position;
+		vec2 angle;
+	};
+	vector<Frame> frames;
+	
+	void record(double time, const Spectator& spectator);
+	// moves the spectator to where it was at the time, between the
+	// recorded frames. Returns false once the time is past the end
+	bool play(double time, Spectator* spectator) const;
+	double length() const;
+	
+	// one frame per line, as the time, position and angle
+	bool to_file(string path) const;
+	bool from_file(string path);
 };
 
 
@@ -3,9 +3,24 @@
 #include "blocks.h"
 #include "blockdata.h"
 #include "blockiter.h"
+#include "terraingraph.h"
+#include "fileformat.h"
+#include "threadpool/pool.h"
 
 #include <sstream>
 #include <algorithm>
+#include <limits>
+#include <thread>
+#include <condition_variable>
+
+bool PARAM(interval_bounds) = true;
+bool PARAM(cave_generation) = true;
+bool PARAM(climate_tiles) = true;
+int PARAM(climate_cache_tiles) = 256;
+int PARAM(height_min) = -1024;
+int PARAM(height_max) = 1024;
+// number of height tiles kept by each generator
+int PARAM(height_cache_tiles) = 512;
 
 int hash4(int seed, int a, int b, int c, int d) {
 	int sum = seed + 13680553*a + 47563643*b + 84148333*c + 80618477*d;
@@ -226,93 +241,278 @@ float perlin2d(int seed, float x, float y) {
 
 
 
+// Interval versions of the noise functions. Each lattice cell the box
+// touches is evaluated with interval arithmetic, which gives a range the
+// noise is guaranteed to stay in. Boxes that cover too many cells
+// use the max possible value of the noise instead
 
+struct NoiseInterval {
+	float lower;
+	float upper;
+};
+
+const int max_bound_cells = 4;
+// |gradient| * max |distance to corner| * normalization
+const float perlin3d_max = 1.41421356f * 1.73205081f * 0.964921414852142333984375f;
+const float perlin2d_max = 1.41421356f * 1.4247691104677813f;
+
+NoiseInterval interval_mul(float val, NoiseInterval inter) {
+	if (val >= 0) {
+		return {val * inter.lower, val * inter.upper};
+	} else {
+		return {val * inter.upper, val * inter.lower};
+	}
+}
 
+NoiseInterval interval_add(NoiseInterval inter1, NoiseInterval inter2) {
+	return {inter1.lower + inter2.lower, inter1.upper + inter2.upper};
+}
+
+// lerp where the amount is in [0,1]: the result rises with both values,
+// and is linear in the amount, so the extremes are at the ends
+NoiseInterval interval_lerp(NoiseInterval a, NoiseInterval b, NoiseInterval t) {
+	return {
+		std::min(lerp(a.lower, b.lower, t.lower), lerp(a.lower, b.lower, t.upper)),
+		std::max(lerp(a.upper, b.upper, t.lower), lerp(a.upper, b.upper, t.upper))
+	};
+}
+
+// interp_quintic only rises on [0,1]
+NoiseInterval interval_quintic(NoiseInterval t) {
+	return {interp_quintic(t.lower), interp_quintic(t.upper)};
+}
 
+NoiseInterval interval_offset(NoiseInterval inter, float off) {
+	return {inter.lower + off, inter.upper + off};
+}
 
+NoiseInterval interval_grad_coord(int seed, int xPrimed, int yPrimed, int zPrimed, NoiseInterval xd, NoiseInterval yd, NoiseInterval zd) {
+  int hash = fasthash(seed, xPrimed, yPrimed, zPrimed);
+  hash ^= hash >> 15;
+  hash &= 63 << 2;
 
+	return interval_add(interval_add(
+		interval_mul(gradient_table3d[hash], xd),
+		interval_mul(gradient_table3d[hash | 1], yd)),
+		interval_mul(gradient_table3d[hash | 2], zd)
+	);
+}
 
+NoiseInterval interval_grad_coord(int seed, int xPrimed, int yPrimed, NoiseInterval xd, NoiseInterval yd) {
+  int hash = fasthash(seed, xPrimed, yPrimed);
+  hash ^= hash >> 15;
+  hash &= 127 << 1;
 
+	return interval_add(
+		interval_mul(gradient_table2d[hash], xd),
+		interval_mul(gradient_table2d[hash | 1], yd)
+	);
+}
 
+NoiseInterval perlin3d_cell(int seed, ivec3 cell, NoiseInterval xd0, NoiseInterval yd0, NoiseInterval zd0) {
+	NoiseInterval xd1 = interval_offset(xd0, -1);
+	NoiseInterval yd1 = interval_offset(yd0, -1);
+	NoiseInterval zd1 = interval_offset(zd0, -1);
 
+	NoiseInterval xs = interval_quintic(xd0);
+	NoiseInterval ys = interval_quintic(yd0);
+	NoiseInterval zs = interval_quintic(zd0);
 
+	int x0 = cell.x * PrimeX;
+	int y0 = cell.y * PrimeY;
+	int z0 = cell.z * PrimeZ;
+	int x1 = x0 + PrimeX;
+	int y1 = y0 + PrimeY;
+	int z1 = z0 + PrimeZ;
 
+	NoiseInterval xf00 = interval_lerp(interval_grad_coord(seed, x0, y0, z0, xd0, yd0, zd0), interval_grad_coord(seed, x1, y0, z0, xd1, yd0, zd0), xs);
+	NoiseInterval xf10 = interval_lerp(interval_grad_coord(seed, x0, y1, z0, xd0, yd1, zd0), interval_grad_coord(seed, x1, y1, z0, xd1, yd1, zd0), xs);
+	NoiseInterval xf01 = interval_lerp(interval_grad_coord(seed, x0, y0, z1, xd0, yd0, zd1), interval_grad_coord(seed, x1, y0, z1, xd1, yd0, zd1), xs);
+	NoiseInterval xf11 = interval_lerp(interval_grad_coord(seed, x0, y1, z1, xd0, yd1, zd1), interval_grad_coord(seed, x1, y1, z1, xd1, yd1, zd1), xs);
 
+	NoiseInterval yf0 = interval_lerp(xf00, xf10, ys);
+	NoiseInterval yf1 = interval_lerp(xf01, xf11, ys);
 
+	return interval_mul(0.964921414852142333984375f, interval_lerp(yf0, yf1, zs));
+}
+
+NoiseInterval perlin2d_cell(int seed, ivec2 cell, NoiseInterval xd0, NoiseInterval yd0) {
+	NoiseInterval xd1 = interval_offset(xd0, -1);
+	NoiseInterval yd1 = interval_offset(yd0, -1);
+
+	NoiseInterval xs = interval_quintic(xd0);
+	NoiseInterval ys = interval_quintic(yd0);
+
+	int x0 = cell.x * PrimeX;
+	int y0 = cell.y * PrimeY;
+	int x1 = x0 + PrimeX;
+	int y1 = y0 + PrimeY;
+
+	NoiseInterval xf0 = interval_lerp(interval_grad_coord(seed, x0, y0, xd0, yd0), interval_grad_coord(seed, x1, y0, xd1, yd0), xs);
+	NoiseInterval xf1 = interval_lerp(interval_grad_coord(seed, x0, y1, xd0, yd1), interval_grad_coord(seed, x1, y1, xd1, yd1), xs);
+
+	return interval_mul(1.4247691104677813f, interval_lerp(xf0, xf1, ys));
+}
+
+// the part of the range [low, high] that is in the cell starting at cellpos,
+// relative to the cell
+NoiseInterval cell_range(float low, float high, int cellpos) {
+	return {std::max(low - cellpos, 0.0f), std::min(high - cellpos, 1.0f)};
+}
+
+vec2 perlin3d_bounds(int seed, vec3 low, vec3 high) {
+	ivec3 start (fastfloor(low.x), fastfloor(low.y), fastfloor(low.z));
+	ivec3 end (fastfloor(high.x), fastfloor(high.y), fastfloor(high.z));
+
+	if (end.x - start.x >= max_bound_cells or end.y - start.y >= max_bound_cells or end.z - start.z >= max_bound_cells) {
+		return vec2(-perlin3d_max, perlin3d_max);
+	}
+
+	NoiseInterval result = {999999, -999999};
+	for (int x = start.x; x <= end.x; x ++) {
+		for (int y = start.y; y <= end.y; y ++) {
+			for (int z = start.z; z <= end.z; z ++) {
+				NoiseInterval cellresult = perlin3d_cell(seed, ivec3(x,y,z),
+					cell_range(low.x, high.x, x), cell_range(low.y, high.y, y), cell_range(low.z, high.z, z));
+				result.lower = std::min(result.lower, cellresult.lower);
+				result.upper = std::max(result.upper, cellresult.upper);
+			}
+		}
+	}
+	return vec2(result.lower, result.upper);
+}
+
+vec2 perlin2d_bounds(int seed, vec2 low, vec2 high) {
+	ivec2 start (fastfloor(low.x), fastfloor(low.y));
+	ivec2 end (fastfloor(high.x), fastfloor(high.y));
+
+	if (end.x - start.x >= max_bound_cells or end.y - start.y >= max_bound_cells) {
+		return vec2(-perlin2d_max, perlin2d_max);
+	}
+
+	NoiseInterval result = {999999, -999999};
+	for (int x = start.x; x <= end.x; x ++) {
+		for (int y = start.y; y <= end.y; y ++) {
+			NoiseInterval cellresult = perlin2d_cell(seed, ivec2(x,y),
+				cell_range(low.x, high.x, x), cell_range(low.y, high.y, y));
+			result.lower = std::min(result.lower, cellresult.lower);
+			result.upper = std::max(result.upper, cellresult.upper);
+		}
+	}
+	return vec2(result.lower, result.upper);
+}
 
 
 
 
 
 
-TerrainValue::TerrainValue(): value(0), deriv(0) {
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+const float unbounded = std::numeric_limits<float>::infinity();
+
+// multiplication for bounds, where zero times infinity is zero
+float bound_mul(float a, float b) {
+	return (a == 0 or b == 0) ? 0 : a * b;
+}
+
+TerrainValue::TerrainValue(): value(0), deriv(0), lower(0), upper(0) {
+	
+}
+
+TerrainValue::TerrainValue(float newvalue, float newderiv): value(newvalue), deriv(newderiv),
+lower(newderiv == 0 ? newvalue : -unbounded), upper(newderiv == 0 ? newvalue : unbounded) {
+	
+}
+
+TerrainValue::TerrainValue(float newvalue, float newderiv, float spread): value(newvalue), deriv(newderiv),
+lower(newvalue - spread), upper(newvalue + spread) {
 	
 }
 
-TerrainValue::TerrainValue(float newvalue, float newderiv): value(newvalue), deriv(newderiv) {
+TerrainValue::TerrainValue(float newvalue, float newderiv, float newlower, float newupper): value(newvalue), deriv(newderiv),
+lower(newlower), upper(newupper) {
 	
 }
 
 TerrainValue TerrainValue::operator+(const TerrainValue& other) const {
-	return TerrainValue(value + other.value, deriv + other.deriv);
+	return TerrainValue(value + other.value, deriv + other.deriv, lower + other.lower, upper + other.upper);
 }
 TerrainValue TerrainValue::operator-(const TerrainValue& other) const {
-	return TerrainValue(value - other.value, deriv + other.deriv);
+	return TerrainValue(value - other.value, deriv + other.deriv, lower - other.upper, upper - other.lower);
 }
 TerrainValue TerrainValue::operator*(const TerrainValue& other) const {
 	float dist1 = std::abs(value / deriv), dist2 = std::abs(other.value / other.deriv);
 	float newval = value * other.value;
 	float newdist = std::min(dist1, dist2);
-	return TerrainValue(newval, std::abs(newdist * newval));
+	float bounds[] = {
+		bound_mul(lower, other.lower), bound_mul(lower, other.upper),
+		bound_mul(upper, other.lower), bound_mul(upper, other.upper)
+	};
+	return TerrainValue(newval, std::abs(newdist * newval),
+		*std::min_element(bounds, bounds+4), *std::max_element(bounds, bounds+4));
 	//return TerrainValue(value * other.value, deriv*std::abs(other.value) + std::abs(value)*other.deriv);
 }
 
 TerrainValue TerrainValue::operator+(float val) const {
-	return TerrainValue(value + val, deriv);
+	return TerrainValue(value + val, deriv, lower + val, upper + val);
 }
 TerrainValue TerrainValue::operator-(float val) const {
-	return TerrainValue(value - val, deriv);
+	return TerrainValue(value - val, deriv, lower - val, upper - val);
 }
 TerrainValue TerrainValue::operator*(float val) const {
-	return TerrainValue(value * val, deriv * std::abs(val));
+	if (val >= 0) {
+		return TerrainValue(value * val, deriv * val, bound_mul(lower, val), bound_mul(upper, val));
+	}
+	return TerrainValue(value * val, deriv * -val, bound_mul(upper, val), bound_mul(lower, val));
 }
 TerrainValue TerrainValue::operator/(float val) const {
-	return TerrainValue(value / val, deriv / std::abs(val));
+	return *this * (1 / val);
 }
 
 TerrainValue& TerrainValue::operator+=(const TerrainValue& other) {
-	value += other.value;
-	deriv += other.deriv;
-	return *this;
+	return *this = *this + other;
 }
 TerrainValue& TerrainValue::operator-=(const TerrainValue& other) {
-	value -= other.value;
-	deriv += other.deriv;
-	return *this;
+	return *this = *this - other;
 }
 TerrainValue& TerrainValue::operator*=(const TerrainValue& other) {
+	float bounds[] = {
+		bound_mul(lower, other.lower), bound_mul(lower, other.upper),
+		bound_mul(upper, other.lower), bound_mul(upper, other.upper)
+	};
 	value *= other.value;
 	deriv = deriv*std::abs(other.value) + std::abs(value)*other.deriv;
+	lower = *std::min_element(bounds, bounds+4);
+	upper = *std::max_element(bounds, bounds+4);
 	return *this;
 }
 
 TerrainValue& TerrainValue::operator+=(float val) {
-	value += val;
-	return *this;
+	return *this = *this + val;
 }
 TerrainValue& TerrainValue::operator-=(float val) {
-	value -= val;
-	return *this;
+	return *this = *this - val;
 }
 TerrainValue& TerrainValue::operator*=(float val) {
-	value *= val;
-	deriv *= std::abs(val);
-	return *this;
+	return *this = *this * val;
 }
 TerrainValue& TerrainValue::operator/=(float val) {
-	value /= val;
-	deriv /= std::abs(val);
-	return *this;
+	return *this = *this / val;
 }
 
 
@@ -324,11 +524,12 @@ bool TerrainValue::operator>(const TerrainValue& other) const {
 }
 
 TerrainValue TerrainValue::lerp(const TerrainValue& val1, const TerrainValue& val2, float amount) {
-	return TerrainValue(val1.value * (1-amount) + val2.value * amount, val1.deriv * (1-amount) + val2.deriv * amount);
+	return val1 * (1-amount) + val2 * amount;
 }
 
 TerrainValue TerrainValue::min(const TerrainValue& val1, const TerrainValue& val2) {
-	return TerrainValue(std::min(val1.value, val2.value), std::max(val1.deriv, val2.deriv));
+	return TerrainValue(std::min(val1.value, val2.value), std::max(val1.deriv, val2.deriv),
+		std::min(val1.lower, val2.lower), std::min(val1.upper, val2.upper));
 	//if (val1.value / val1.deriv > val2.value / val2.deriv) {
 	//	return val2;
 	//} else {
@@ -337,7 +538,8 @@ TerrainValue TerrainValue::min(const TerrainValue& val1, const TerrainValue& val
 }
 
 TerrainValue TerrainValue::max(const TerrainValue& val1, const TerrainValue& val2) {
-	return TerrainValue(std::max(val1.value, val2.value), std::max(val1.deriv, val2.deriv));
+	return TerrainValue(std::max(val1.value, val2.value), std::max(val1.deriv, val2.deriv),
+		std::max(val1.lower, val2.lower), std::max(val1.upper, val2.upper));
 	//if (val1.value / val1.deriv < val2.value / val2.deriv) {
 	//	return val2;
 	//} else {
@@ -346,58 +548,103 @@ TerrainValue TerrainValue::max(const TerrainValue& val1, const TerrainValue& val
 }
 
 TerrainValue TerrainValue::abs(const TerrainValue& val) {
-	return TerrainValue(std::abs(val.value), val.deriv);
+	if (val.lower >= 0) {
+		return TerrainValue(std::abs(val.value), val.deriv, val.lower, val.upper);
+	} else if (val.upper <= 0) {
+		return TerrainValue(std::abs(val.value), val.deriv, -val.upper, -val.lower);
+	}
+	return TerrainValue(std::abs(val.value), val.deriv, 0, std::max(-val.lower, val.upper));
 }
 
 TerrainValue default_falloff(const Layers* layers) {
 	return TerrainValue(1,0);
 }
 
-ShapeValue::ShapeValue(const TerrainValue& terrvalue, BlockData* block, LayerFunc layergen, BiomeFunc biome):
-TerrainValue(terrvalue), btype(block), layergen(layergen), biome(biome), falloff(default_falloff) {
-	
+bool TerrainValue::needs_split(int scale) const {
+	if (interval_bounds) {
+		return scale > 1 and lower < 0 and upper > 0;
+	}
+	return std::abs(value) < (scale-1) * 1.73f * deriv;
 }
 
-ShapeValue::ShapeValue(const TerrainValue& terrvalue, ShapeFunc falloff, BlockData* block, LayerFunc layergen, BiomeFunc biome):
-TerrainValue(terrvalue), btype(block), layergen(layergen), biome(biome), falloff(falloff) {
-	
-}
 
-bool ShapeValue::operator<(const ShapeValue& other) const {
-	return value < other.value;
-}
-bool ShapeValue::operator>(const ShapeValue& other) const {
-	return value > other.value;
+
+TerrainValue perlin2d(TerrainContext* ctx, vec3 pos, int scale, int height, int layer) {
+	float value = perlin2d(ctx->seed + layer, pos.x / float(scale), pos.z / float(scale)) * height / 2;
+	float deriv = 1.5f * height / scale;
+	if (ctx->radius == 0) {
+		return TerrainValue(value, deriv);
+	}
+	vec2 low = vec2(pos.x - ctx->radius, pos.z - ctx->radius) / float(scale);
+	vec2 high = vec2(pos.x + ctx->radius, pos.z + ctx->radius) / float(scale);
+	vec2 bounds = perlin2d_bounds(ctx->seed + layer, low, high) * (height / 2.0f);
+	return TerrainValue(value, deriv, bounds.x, bounds.y);
 }
 
-bool ShapeValue::needs_split(int scale) {
-	return std::abs(value) < (scale-1) * 1.73f * deriv;
+
+TerrainValue perlin3d(TerrainContext* ctx, vec3 pos, int scale, int height, int layer) {
+	float value = perlin3d(ctx->seed + layer, pos.x / float(scale), pos.y / float(scale), pos.z / float(scale)) * height / 2;
+	float deriv = 1.5f * height / scale;
+	if (ctx->radius == 0) {
+		return TerrainValue(value, deriv);
+	}
+	vec3 low = (pos - ctx->radius) / float(scale);
+	vec3 high = (pos + ctx->radius) / float(scale);
+	vec2 bounds = perlin3d_bounds(ctx->seed + layer, low, high) * (height / 2.0f);
+	return TerrainValue(value, deriv, bounds.x, bounds.y);
 }
 
 
 
-TerrainValue perlin2d(int seed, vec3 pos, int scale, int height, int layer = 0) {
-	return TerrainValue(
-		perlin2d(seed + layer, pos.x / float(scale), pos.z / float(scale)) * height / 2,
-		1.5f * height / scale
-	);
-}
 
+bool PARAM(octave_culling) = true;
 
-TerrainValue perlin3d(int seed, vec3 pos, int scale, int height, int layer) {
-	return TerrainValue(
-		perlin3d(seed + layer, pos.x / float(scale), pos.y / float(scale), pos.z / float(scale)) * height / 2,
-		1.5f * height / scale
-	);
+// fractal noise, made of octaves of perlin noise that each have half the
+// scale and height of the last. Octaves smaller than the node being generated
+// are skipped, but their deriv and range are still added, so the bounds hold
+TerrainValue fbm2d(TerrainContext* ctx, vec3 pos, int scale, int height, int octaves, int layer) {
+	TerrainValue result (0, 0);
+	for (int i = 0; i < octaves and scale > 0; i ++) {
+		if (octave_culling and scale < ctx->scale) {
+			float amplitude = perlin2d_max * height / 2;
+			result += TerrainValue(0, 1.5f * height / scale, -amplitude, amplitude);
+		} else {
+			result += perlin2d(ctx, pos, scale, height, layer + i * 64);
+		}
+		scale /= 2;
+		height /= 2;
+	}
+	return result;
 }
 
+TerrainValue fbm3d(TerrainContext* ctx, vec3 pos, int scale, int height, int octaves, int layer) {
+	TerrainValue result (0, 0);
+	for (int i = 0; i < octaves and scale > 0; i ++) {
+		if (octave_culling and scale < ctx->scale) {
+			float amplitude = perlin3d_max * height / 2;
+			result += TerrainValue(0, 1.5f * height / scale, -amplitude, amplitude);
+		} else {
+			result += perlin3d(ctx, pos, scale, height, layer + i * 64);
+		}
+		scale /= 2;
+		height /= 2;
+	}
+	return result;
+}
 
 
 
 
+LerpLayerGen::LerpLayerGen(TerrainContext* oldctx, LayerFunc shape, vec3 samplepoint, float scale, LerpLayerGen* prevlayergen):
+position(samplepoint), scale(scale), pointctx(*oldctx), shape(shape), prevlayergen(prevlayergen) {
+	pointctx.radius = 0;
+	pointctx.scale = 0;
+}
 
-
-LerpLayerGen::LerpLayerGen(TerrainContext* ctx, LayerFunc shape, vec3 samplepoint, float scale): position(samplepoint), scale(scale) {
+void LerpLayerGen::sample() {
+	sampled = true;
+	vec3 samplepoint = position;
+	TerrainContext* ctx = &pointctx;
 	float max_val[Layers::num_layers];
 	std::fill(max_val, max_val+Layers::num_layers, -999999);
 	float min_val[Layers::num_layers];
@@ -406,6 +653,9 @@ LerpLayerGen::LerpLayerGen(TerrainContext* ctx, LayerFunc shape, vec3 samplepoin
 		vec3 off (i/4, i/2%2, i%2);
 		off *= scale;
 		Layers tmplayers;
+		if (prevlayergen != nullptr) {
+			prevlayergen->add_value(&tmplayers, samplepoint + off);
+		}
 		shape(ctx, &tmplayers, samplepoint + off);
 		for (int j = 0; j < Layers::num_layers; j ++) {
 			float val = tmplayers.layers()[j].value;
@@ -421,10 +671,25 @@ LerpLayerGen::LerpLayerGen(TerrainContext* ctx, LayerFunc shape, vec3 samplepoin
 	}
 }
 
-void LerpLayerGen::add_value(Layers* outlayers, vec3 pos) {
+bool LerpLayerGen::has_samples() const {
+	return sampled;
+}
+
+void LerpLayerGen::add_value(Layers* outlayers, vec3 pos, float radius) {
+	if (!sampled) {
+		sample();
+	}
+	
+	vec3 off = (pos - position) / scale;
+	vec3 low = glm::max(off - radius / scale, vec3(0,0,0));
+	vec3 high = glm::min(off + radius / scale, vec3(1,1,1));
+	
 	for (int i = 0; i < Layers::num_layers; i ++) {
-		vec3 off = (pos - position) / scale;
-		
+		if (max_deriv[i] == 0) {
+			outlayers->layers()[i] += TerrainValue(samples[0].values[i], 0);
+			continue;
+		}
+
 		float x0 = lerp(samples[0].values[i], samples[4].values[i], off.x);
 		float x1 = lerp(samples[1].values[i], samples[5].values[i], off.x);
 		float x2 = lerp(samples[2].values[i], samples[6].values[i], off.x);
@@ -433,7 +698,32 @@ void LerpLayerGen::add_value(Layers* outlayers, vec3 pos) {
 		float y0 = lerp(x0, x2, off.y);
 		float y1 = lerp(x1, x3, off.y);
 		
-		outlayers->layers()[i] += TerrainValue(lerp(y0, y1, off.z), max_deriv[i]);
+		if (radius == 0) {
+			outlayers->layers()[i] += TerrainValue(lerp(y0, y1, off.z), max_deriv[i]);
+			continue;
+		}
+		
+		// the interpolation is linear along each axis, so its
+		// extremes over the box are at the corners of the box
+		float edges[4][2];
+		for (int j = 0; j < 4; j ++) {
+			edges[j][0] = lerp(samples[j].values[i], samples[j+4].values[i], low.x);
+			edges[j][1] = lerp(samples[j].values[i], samples[j+4].values[i], high.x);
+		}
+		float lower = 999999, upper = -999999;
+		for (int xi = 0; xi < 2; xi ++) {
+			for (float y : {low.y, high.y}) {
+				float z0 = lerp(edges[0][xi], edges[2][xi], y);
+				float z1 = lerp(edges[1][xi], edges[3][xi], y);
+				for (float z : {low.z, high.z}) {
+					float val = lerp(z0, z1, z);
+					lower = std::min(lower, val);
+					upper = std::max(upper, val);
+				}
+			}
+		}
+		
+		outlayers->layers()[i] += TerrainValue(lerp(y0, y1, off.z), max_deriv[i], lower, upper);
 	}
 }
 
@@ -444,208 +734,406 @@ void add_layergen(TerrainContext* ctx, Layers* outlayers, vec3 pos) {
 }
 
 
-BiomeResult mountain_biome(TerrainContext* ctx, const Layers* layers, ivec3 pos, int scale);
-BiomeResult generate_biome_shapes(vector<ShapeValue> shapes, ivec3 pos, int scale) {
-	for (ShapeValue val : shapes) {
-		if (val.needs_split(scale) or val.value < 0) {
-			BiomeResult result;
-			result.blocktype = val.btype;
-			result.nextlayergen = val.layergen;
-			result.nextbiome = val.biome;
-			result.needs_split = val.needs_split(scale);
-			result.falloff = val.falloff;
-			return result;
-		}
-	}
-	BiomeResult result;
-	result.blocktype = nullptr;
-	result.nextlayergen = nullptr;
-	result.nextbiome = nullptr;
-	result.needs_split = false;
-	result.falloff = default_falloff;
-	return result;
-}
-
-
-
-BiomeResult mountain_biome(TerrainContext* ctx, const Layers* layers, ivec3 pos, int scale) {
-	return generate_biome_shapes({
-		//ShapeValue(TerrainValue::max(layers->ground_level, perlin2d(ctx->seed, pos, 32, 8, 4) + TerrainValue(50-pos.y, 1)), &blocktypes::snow),
-		ShapeValue(layers->stone_level, &blocktypes::stone),
-		ShapeValue(layers->ground_level, &blocktypes::snow)
-	}, pos, scale);
-}
-
 void mountain_layergen(TerrainContext* ctx, Layers* outlayers, vec3 pos) {
 	TerrainValue falloff = TerrainValue::min(ctx->falloff(outlayers) * -8.0f, TerrainValue(1,0));
-	outlayers->ground_level -= (perlin2d(ctx->seed, pos, 64, 64, 2) + 32) * falloff;
-	outlayers->stone_level -= (perlin2d(ctx->seed, pos+vec3(0,10,0), 64, 64, 2) + 32) * falloff;
+	outlayers->ground_level -= (perlin2d(ctx, pos, 64, 64, 2) + 32) * falloff;
+	outlayers->stone_level -= (perlin2d(ctx, pos+vec3(0,10,0), 64, 64, 2) + 32) * falloff;
 }
 
+struct MountainBiome {
+	static constexpr LayerFunc layergen = mountain_layergen;
+	using shapes = ShapeList<
+		//SolidShape<snowcap_shape, &blocktypes::snow>,
+		SolidShape<layer_value<&Layers::stone_level>, &blocktypes::stone>,
+		SolidShape<layer_value<&Layers::ground_level>, &blocktypes::snow>
+	>;
+};
+
 
 
 void plains_layergen(TerrainContext* ctx, Layers* layers, vec3 pos) {
 	TerrainValue falloff = TerrainValue::min(ctx->falloff(layers) * -8.0f, TerrainValue(1,0));
-	layers->ground_level += falloff * pos.y * 5;
-	layers->stone_level += falloff * (pos.y + 10) * 5;
+	layers->ground_level += falloff * TerrainValue(pos.y * 5, 5, ctx->radius * 5);
+	layers->stone_level += falloff * TerrainValue((pos.y + 10) * 5, 5, ctx->radius * 5);
 }
 
-BiomeResult plains_biome(TerrainContext* ctx, const Layers* layers, ivec3 pos, int scale) {
-	return generate_biome_shapes({
-		ShapeValue(layers->stone_level, &blocktypes::stone),
-		ShapeValue(layers->ground_level, &blocktypes::grass)
-	}, pos, scale);
-}
+struct PlainsBiome {
+	static constexpr LayerFunc layergen = plains_layergen;
+	using shapes = ShapeList<
+		SolidShape<layer_value<&Layers::stone_level>, &blocktypes::stone>,
+		SolidShape<layer_value<&Layers::ground_level>, &blocktypes::grass>
+	>;
+};
 
 TerrainValue root_groundlevel(TerrainContext* ctx, Layers* layers, vec3 pos) {
-	TerrainValue val = TerrainValue::abs(perlin2d(ctx->seed, pos, 64, 128, 5)) * -1.0f;
-	TerrainValue val2 = TerrainValue::abs(perlin2d(ctx->seed, pos, 64, 128, 6)) * -1.0f;
-	return TerrainValue(pos.y, 1) + TerrainValue::max(val, TerrainValue(64,0));
-	return TerrainValue(pos.y, 1) + perlin2d(ctx->seed, pos, 64, 32, 5) - 16 + perlin2d(ctx->seed, pos, 31, 16, 6);
-	return TerrainValue(pos.y, 1) + perlin2d(ctx->seed, pos, 64, 32, 5) - 16 + perlin3d(ctx->seed, pos, 65, 65, 3)
-		+ perlin3d(ctx->seed, pos, 31, 31, 4) + perlin3d(ctx->seed, pos, 15, 15, 5);
+	TerrainValue val = TerrainValue::abs(perlin2d(ctx, pos, 64, 128, 5)) * -1.0f;
+	TerrainValue val2 = TerrainValue::abs(perlin2d(ctx, pos, 64, 128, 6)) * -1.0f;
+	return TerrainValue(pos.y, 1, ctx->radius) + TerrainValue::max(val, TerrainValue(64,0));
+	return TerrainValue(pos.y, 1, ctx->radius) + perlin2d(ctx, pos, 64, 32, 5) - 16 + perlin2d(ctx, pos, 31, 16, 6);
+	return TerrainValue(pos.y, 1, ctx->radius) + perlin2d(ctx, pos, 64, 32, 5) - 16 + perlin3d(ctx, pos, 65, 65, 3)
+		+ perlin3d(ctx, pos, 31, 31, 4) + perlin3d(ctx, pos, 15, 15, 5);
 }
 
 void root_layergen(TerrainContext* ctx, Layers* outlayers, vec3 pos) {
-	outlayers->temperature += perlin3d(ctx->seed, pos, 128, 2, 0) - pos.y * 0.01f;
-	outlayers->humidity += perlin3d(ctx->seed, pos, 128, 2, 2);
-	//outlayers->elevation += perlin2d(ctx->seed, pos, 128, 2, 1) - pos.y * 0.01f;
+	// the climate is the same for the whole column, so it can be made in
+	// tiles. Before the tiles it was 3d noise that barely changed with y
+	if (ctx->climate != nullptr) {
+		ctx->climate->add_climate(ctx, outlayers, pos);
+	} else {
+		outlayers->temperature += perlin2d(ctx, pos, 128, 2, 0);
+		outlayers->humidity += perlin2d(ctx, pos, 128, 2, 2);
+	}
+	outlayers->temperature -= TerrainValue(pos.y * 0.01f, 0.01f, ctx->radius * 0.01f);
+	//outlayers->elevation += perlin2d(ctx, pos, 128, 2, 1) - pos.y * 0.01f;
 
-	outlayers->ground_level += perlin2d(ctx->seed, pos, 64, 64, 1) + TerrainValue(pos.y, 1); //root_groundlevel(ctx, outlayers, pos);
+	outlayers->ground_level += fbm2d(ctx, pos, 64, 64, 3, 1) + TerrainValue(pos.y, 1, ctx->radius); //root_groundlevel(ctx, outlayers, pos);
 	//outlayers->stone_level += root_groundlevel(ctx, outlayers, pos+vec3(0,10,0)) - 10;
+	
+	// caves stay a few blocks under the ground, so the noise
+	// is only needed when part of the node is that deep
+	TerrainValue cave_depth = outlayers->ground_level + 4;
+	if (ctx->caves and cave_depth.lower <= 0) {
+		// tunnels are where two noise functions are both near zero
+		TerrainValue tunnel1 = TerrainValue::abs(perlin3d(ctx, pos, 128, 128, 20));
+		TerrainValue tunnel2 = TerrainValue::abs(perlin3d(ctx, pos, 128, 128, 21));
+		TerrainValue tunnels = TerrainValue::max(tunnel1, tunnel2) - 4;
+		outlayers->caves += TerrainValue::max(tunnels, cave_depth);
+	} else if (ctx->caves) {
+		outlayers->caves += cave_depth;
+	} else {
+		outlayers->caves += TerrainValue(1, 0);
+	}
 }
 
-BiomeResult root_biome(TerrainContext* ctx, const Layers* layers, ivec3 pos, int scale) {
-	//return generate_biome_shapes({ShapeValue(layers->ground_level, &blocktypes::dirt)}, pos, scale);
-	TerrainValue ground_area = TerrainValue::abs(layers->ground_level) * -1.0f + 256.0f;
-	
-	ShapeFunc coldfunc = [] (const Layers* layers) {
-		return layers->temperature + 0.33f;
-	};
-	ShapeFunc hotfunc = [] (const Layers* layers) {
-		return layers->temperature * -1.0f + 0.33f;
-	};
+TerrainValue cold_shape(const Layers* layers) {
+	return layers->temperature + 0.33f;
+}
 
-    /*
-	ShapeFunc lowfunc = [] (const Layers* layers) {
-		return layers->elevation + 0.33f;
-	};
-	ShapeFunc highfunc = [] (const Layers* layers) {
-		return layers->elevation * -1.0f + 0.33f;
-	};
-    */
-	
-	return generate_biome_shapes({
-		ShapeValue(layers->ground_level, &blocktypes::stone),
-		//ShapeValue(highfunc(layers), &blocktypes::stone, &mountain_layergen, &mountain_biome),
-		//ShapeValue(lowfunc(layers), &blocktypes::grass, &plains_layergen, &plains_biome)
-		//ShapeValue(layers->stone_level, &blocktypes::stone),
-		//ShapeValue(layers->ground_level, &blocktypes::dirt)
-	}, pos, scale);
+TerrainValue hot_shape(const Layers* layers) {
+	return layers->temperature * -1.0f + 0.33f;
 }
 
-void zero_layergen(TerrainContext* ctx, Layers* layers, vec3 pos) {}
+struct RootBiome {
+	static constexpr LayerFunc layergen = root_layergen;
+	using shapes = ShapeList<
+		SolidShape<layer_value<&Layers::caves>, nullptr>,
+		SolidShape<layer_value<&Layers::ground_level>, &blocktypes::stone>
+		//BiomeShape<hot_shape, MountainBiome>,
+		//BiomeShape<cold_shape, PlainsBiome>
+	>;
+};
 
-//template <LayerFunc layerfunc, 
-//void interp_layergen(TerrainContext* ctx, Layers* layers, vec3 pos) {
-	
+// the mountains and plains raise and lower both levels, so the
+// stone is kept a few blocks under the ground
+void climate_layergen(TerrainContext* ctx, Layers* outlayers, vec3 pos) {
+	outlayers->stone_level += outlayers->ground_level + 4;
+}
+
+struct ClimateRootBiome {
+	static constexpr LayerFunc layergen = add_layergen<root_layergen, climate_layergen>;
+	using shapes = ShapeList<
+		SolidShape<layer_value<&Layers::caves>, nullptr>,
+		BiomeShape<hot_shape, MountainBiome>,
+		BiomeShape<cold_shape, PlainsBiome>,
+		SolidShape<layer_value<&Layers::stone_level>, &blocktypes::stone>,
+		SolidShape<layer_value<&Layers::ground_level>, &blocktypes::dirt>
+	>;
+};
+
+void zero_layergen(TerrainContext* ctx, Layers* layers, vec3 pos) {}
 
 
 
-LayerFunc BiomeGenerator::root_layergen = &::root_layergen;
 
-BiomeFunc BiomeGenerator::root_biome = &::root_biome;
+// update this when the biomes are changed
+int BiomeGenerator::version() {
+	return 4;
+}
 
-void BiomeGenerator::generate_chunk(NodeView node, int depth) {
-	TerrainContext context;
-	context.seed = seed;
-	context.falloff = &default_falloff;
-	LerpLayerGen initial_gen (&context, zero_layergen, node.position, node.scale);
-	gen_node(node, &initial_gen, root_layergen, root_biome, depth, default_falloff);
+int ClimateBiomeGenerator::version() {
+	return 1;
 }
 
-BlockData* BiomeGenerator::gen_node(NodeView node, LerpLayerGen* prevlayergen, LayerFunc layergen, BiomeFunc biome, int depth, ShapeFunc falloff) {
-	vec3 pos = node.position;
-	pos += float(node.scale)/2;
-	TerrainContext context;
-	context.seed = seed;
-	context.falloff = falloff;
+// exported before BiomeGenerator, so BiomeGenerator stays the default
+EXPORT_PLUGIN(GraphGenerator);
+EXPORT_PLUGIN(SubDivGenerator);
+EXPORT_PLUGIN(ClimateBiomeGenerator);
+EXPORT_PLUGIN(BiomeGenerator);
+
+
+
+
+
+
+
+
+
+
+
+
+
+DEFINE_PLUGIN(TerrainGenerator);
+
+TerrainGenerator::TerrainGenerator(int newseed): seed(newseed), heightcache(height_cache_tiles), climate(newseed) {
 	
-	Layers layers;
-	prevlayergen->add_value(&layers, pos);
-	layergen(&context, &layers, pos);
+}
 
-	BiomeResult result = biome(&context, &layers, node.position, node.scale);
-	//cout << result.falloff.value << "--------------" << endl;
-	//cout << result.falloff.value << ' ' << (void*)biome << ' ' << (void*)&mountain_biome << endl;
-	//result.nextlayergen = nullptr;
-	//result.nextbiome = nullptr;
+void TerrainGenerator::generate_stream(ivec3 position, int scale, int depth, string* out) {
+	BlockContainer container (position, scale);
+	generate_chunk(container, depth);
+	std::ostringstream stream;
+	SequentialFileFormat().to_file(container, stream);
+	*out += stream.str();
+}
+
+int TerrainGenerator::get_height(ivec3 pos) {
+	ivec2 tilepos = safefloor(vec2(pos.x, pos.z) / float(HeightTile::size)) * HeightTile::size;
+	std::shared_ptr<const HeightTile> tile = get_height_tile(tilepos);
+	return tile->heights[(pos.x - tilepos.x) * HeightTile::size + pos.z - tilepos.y];
+}
+
+void TerrainGenerator::get_heights(ivec2 start, ivec2 size, int* heights) {
+	ivec2 end = start + size;
+	ivec2 starttile = safefloor(vec2(start) / float(HeightTile::size)) * HeightTile::size;
 	
-	if (result.needs_split) {
-		node.split();
-		
-		BlockData* blocktype = gen_node(node.child(0), prevlayergen, layergen, biome, depth-1, falloff);
-		for (int i = 1; i < BDIMS3; i ++) {
-			BlockData* newtype = gen_node(node.child(i), prevlayergen, layergen, biome, depth-1, falloff);
-			blocktype = (newtype == blocktype) ? blocktype : BLOCK_SPLIT;
+	for (int tilex = starttile.x; tilex < end.x; tilex += HeightTile::size) {
+		for (int tilez = starttile.y; tilez < end.y; tilez += HeightTile::size) {
+			std::shared_ptr<const HeightTile> tile = get_height_tile(ivec2(tilex, tilez));
+			ivec2 low = glm::max(start, tile->position);
+			ivec2 high = glm::min(end, tile->position + HeightTile::size);
+			for (int x = low.x; x < high.x; x ++) {
+				int tileindex = (x - tilex) * HeightTile::size + low.y - tilez;
+				int outindex = (x - start.x) * size.y + low.y - start.y;
+				std::copy(tile->heights + tileindex, tile->heights + tileindex + high.y - low.y, heights + outindex);
+			}
 		}
+	}
+}
 
-		if (blocktype != BLOCK_SPLIT) {
-			node.join();
-			node.set_block(new Block(blocktype));
-		}
+std::shared_ptr<const HeightTile> TerrainGenerator::get_height_tile(ivec2 position) {
+	std::shared_ptr<const HeightTile> tile = heightcache.find(position);
+	if (tile == nullptr) {
+		std::shared_ptr<HeightTile> newtile = std::make_shared<HeightTile>();
+		newtile->position = position;
+		gen_height_tile(newtile.get());
+		heightcache.add(newtile);
+		tile = newtile;
+	}
+	return tile;
+}
 
-		return blocktype;
-	} else if (result.nextlayergen != nullptr) {
-		LerpLayerGen lerplayergen (&context, layergen, node.position, node.scale);
-		if (result.nextbiome == nullptr) {
-			return gen_node(node, &lerplayergen, result.nextlayergen, biome, depth, falloff);
-		} else {
-			return gen_node(node, &lerplayergen, result.nextlayergen, result.nextbiome, depth, result.falloff);
+
+
+HeightNode HeightNode::child(NodeIndex index) const {
+	// the children above are given first, so the lower
+	// children can be skipped once the surface is found
+	ivec3 off = index;
+	off.y = BDIMS - 1 - off.y;
+	return HeightNode {position + off * (scale / BDIMS), scale / BDIMS, tile};
+}
+
+bool HeightNode::skip() const {
+	ivec2 off = ivec2(position.x, position.z) - tile->position;
+	for (int x = off.x; x < off.x + scale; x ++) {
+		for (int z = off.y; z < off.y + scale; z ++) {
+			if (tile->heights[x * HeightTile::size + z] < position.y + scale) {
+				return false;
+			}
 		}
-	} else if (result.nextbiome != nullptr) {
-		return gen_node(node, prevlayergen, layergen, result.nextbiome, depth, result.falloff);
-	} else {
-		node.set_block(new Block(result.blocktype));
-		return result.blocktype;
 	}
+	return true;
 }
 
-int BiomeGenerator::get_height(ivec3 pos) {
-	return 0;
+StreamNode StreamNode::child(NodeIndex index) const {
+	return StreamNode {position + ivec3(index) * (scale / BDIMS), scale / BDIMS, out};
 }
 
+void StreamNode::split() {
+	out->push_back('{');
+}
 
+void StreamNode::join() {
+	out->resize(out->size() - BDIMS3 - 1);
+}
 
+void StreamNode::set_type(BlockData* type) {
+	out->push_back(type == nullptr ? 0 : type->id);
+}
 
-EXPORT_PLUGIN(BiomeGenerator);
-
+void HeightNode::set_type(BlockData* type) {
+	if (type == nullptr or type == BLOCK_NULL or type == BLOCK_SPLIT) {
+		return;
+	}
+	ivec2 off = ivec2(position.x, position.z) - tile->position;
+	for (int x = off.x; x < off.x + scale; x ++) {
+		for (int z = off.y; z < off.y + scale; z ++) {
+			int& height = tile->heights[x * HeightTile::size + z];
+			height = std::max(height, position.y + scale);
+		}
+	}
+}
 
 
 
+ClimateMap::ClimateMap(int newseed): seed(newseed), cache(climate_cache_tiles) {
+	
+}
 
+std::shared_ptr<const ClimateTile> ClimateMap::get_tile(ivec2 position) {
+	std::shared_ptr<const ClimateTile> tile = cache.find(position);
+	if (tile == nullptr) {
+		// the same noise as perlin2d(ctx, pos, 128, 2, layer), without the bounds
+		std::shared_ptr<ClimateTile> newtile = std::make_shared<ClimateTile>();
+		newtile->position = position;
+		for (int x = 0; x < ClimateTile::samples; x ++) {
+			for (int z = 0; z < ClimateTile::samples; z ++) {
+				vec2 pos = vec2(position + ivec2(x,z) * ClimateTile::spacing) / 128.0f;
+				newtile->temperature[x * ClimateTile::samples + z] = perlin2d(seed + 0, pos.x, pos.y);
+				newtile->humidity[x * ClimateTile::samples + z] = perlin2d(seed + 2, pos.x, pos.y);
+			}
+		}
+		cache.add(newtile);
+		tile = newtile;
+	}
+	return tile;
+}
 
+void ClimateMap::add_climate(TerrainContext* ctx, Layers* layers, vec3 pos) {
+	const int tilescale = ClimateTile::size * ClimateTile::spacing;
+	const int samples = ClimateTile::samples;
+	const float deriv = 1.5f * 2 / 128;
+	
+	ivec2 tilepos = safefloor(vec2(pos.x, pos.z) / float(tilescale)) * tilescale;
+	std::shared_ptr<const ClimateTile> tile = get_tile(tilepos);
+	vec2 off = (vec2(pos.x, pos.z) - vec2(tilepos)) / float(ClimateTile::spacing);
+	ivec2 cell = glm::min(ivec2(off), ivec2(ClimateTile::size - 1));
+	vec2 frac = off - vec2(cell);
+	
+	float values[2];
+	const float* arrays[2] = {tile->temperature, tile->humidity};
+	for (int i = 0; i < 2; i ++) {
+		const float* samplerow = arrays[i] + cell.x * samples + cell.y;
+		float z0 = lerp(samplerow[0], samplerow[samples], frac.x);
+		float z1 = lerp(samplerow[1], samplerow[samples+1], frac.x);
+		values[i] = lerp(z0, z1, frac.y);
+	}
+	
+	if (ctx->radius == 0) {
+		layers->temperature += TerrainValue(values[0], deriv);
+		layers->humidity += TerrainValue(values[1], deriv);
+		return;
+	}
+	
+	// each interpolated value is between the samples around it, so the
+	// bounds are the extremes of all the samples the cube touches
+	ivec2 low = safefloor(vec2(pos.x - ctx->radius, pos.z - ctx->radius) / float(ClimateTile::spacing));
+	ivec2 high = safefloor(vec2(pos.x + ctx->radius, pos.z + ctx->radius) / float(ClimateTile::spacing)) + 1;
+	float lower[2] = {values[0], values[1]};
+	float upper[2] = {values[0], values[1]};
+	ivec2 lowtile = safefloor(vec2(low) / float(ClimateTile::size)) * ClimateTile::size;
+	for (int tilex = lowtile.x; tilex <= high.x; tilex += ClimateTile::size) {
+		for (int tilez = lowtile.y; tilez <= high.y; tilez += ClimateTile::size) {
+			ivec2 curtilepos = ivec2(tilex, tilez);
+			std::shared_ptr<const ClimateTile> curtile = (curtilepos * ClimateTile::spacing == tilepos)
+				? tile : get_tile(curtilepos * ClimateTile::spacing);
+			ivec2 start = glm::max(low, curtilepos) - curtilepos;
+			ivec2 end = glm::min(high, curtilepos + ClimateTile::size) - curtilepos;
+			for (int x = start.x; x <= end.x; x ++) {
+				for (int z = start.y; z <= end.y; z ++) {
+					int index = x * samples + z;
+					lower[0] = std::min(lower[0], curtile->temperature[index]);
+					upper[0] = std::max(upper[0], curtile->temperature[index]);
+					lower[1] = std::min(lower[1], curtile->humidity[index]);
+					upper[1] = std::max(upper[1], curtile->humidity[index]);
+				}
+			}
+		}
+	}
+	layers->temperature += TerrainValue(values[0], deriv, lower[0], upper[0]);
+	layers->humidity += TerrainValue(values[1], deriv, lower[1], upper[1]);
+}
 
+int TerrainGenerator::version() {
+	return 0;
+}
 
+int TerrainGenerator::depth_scale(int scale, int depth) {
+	for (int i = 0; i < depth and scale > 1; i ++) {
+		scale /= BDIMS;
+	}
+	return std::max(scale, 1);
+}
 
+int TerrainGenerator::full_depth(int scale) {
+	int depth = 0;
+	for (; scale > 1; scale /= BDIMS) {
+		depth ++;
+	}
+	return depth;
+}
 
+// fnv-1a, fingerprints have to be the same between runs
+uint64 TerrainGenerator::hash_setting(uint64 hash, int value) {
+	for (int i = 0; i < int(sizeof(value)); i ++) {
+		hash = (hash ^ uint8(value >> (i*8))) * 1099511628211ull;
+	}
+	return hash;
+}
 
+// the settings of the noise and splitting that all generators share
+uint64 TerrainGenerator::fingerprint() {
+	uint64 hash = 14695981039346656037ull;
+	hash = hash_setting(hash, interval_bounds);
+	hash = hash_setting(hash, octave_culling);
+	return hash;
+}
 
+GenerationStats TerrainGenerator::get_stats() {
+	std::lock_guard guard(stats_lock);
+	return stats;
+}
 
-DEFINE_PLUGIN(TerrainGenerator);
+void TerrainGenerator::add_stats(const GenerationStats& newstats) {
+	std::lock_guard guard(stats_lock);
+	stats += newstats;
+}
 
-TerrainGenerator::TerrainGenerator(int newseed): seed(newseed) {
-	
+GenerationStats& GenerationStats::operator+=(const GenerationStats& other) {
+	splits += other.splits;
+	joins += other.joins;
+	leaves += other.leaves;
+	hops += other.hops;
+	hop_samples += other.hop_samples;
+	return *this;
 }
 
 
 
 DEFINE_PLUGIN(TerrainDecorator);
 
-TerrainDecorator::TerrainDecorator(int newseed): seed(newseed) {
+TerrainDecorator::TerrainDecorator(TerrainGenerator* gen): seed(gen->seed), generator(gen) {
 	
 }
 
+DecorationStats TerrainDecorator::get_stats() {
+	std::lock_guard guard(stats_lock);
+	return stats;
+}
+
+void TerrainDecorator::add_stats(const DecorationStats& newstats) {
+	std::lock_guard guard(stats_lock);
+	stats += newstats;
+}
+
+DecorationStats& DecorationStats::operator+=(const DecorationStats& other) {
+	chunks += other.chunks;
+	structures += other.structures;
+	writes += other.writes;
+	shared += other.shared;
+	time += other.time;
+	return *this;
+}
+
 /*
 
 template <typename Layers, ShapeFunc ... Shapes>
@@ -672,6 +1160,7 @@ void ShapeResolver<Layers,Shapes...>::generate_chunk(NodeView node, int depth) {
 	// }
 	
 	double start = getTime();
+	ASSERT(!node.haschildren());
 	ShapeFunc shapes[] = {Shapes...};
 	gen_node(node, shapes, sizeof...(Shapes), depth);
 	double time = getTime() - start;
@@ -903,76 +1392,158 @@ ShapeValue dirt_level(ShapeContext* ctx, vec3 pos) {
 // >;
 // EXPORT_PLUGIN_TEMPLATE(TestWorld);
 
-int PARAM(min_scale_div) = 1;
-
-struct SubDivGenerator : public TerrainGenerator {
-	PLUGIN(SubDivGenerator);
-	using TerrainGenerator::TerrainGenerator;
-	
-	void gen_node(NodeView node, int depth) {
-		int score = 0;
-		for (int x = -1; x <= 1; x ++) {
-			for (int y = -1; y <= 1; y ++) {
-				for (int z = -1; z <= 1; z ++) {
-					if (x == 0 and y == 0 and z == 0) continue;
-					ivec3 off (x,y,z);
-					NodeView sidenode = node.get_global(node + off);
-					if (sidenode.isvalid()) {
-						if (sidenode.hasblock() and sidenode.block()->type == &blocktypes::stone) {
-							score += sidenode.scale;
-						}
-					} else if (off == ivec3(0,-1,0)) {
-						score += node.scale * 27;
-					}
+*/
+
+
+int PARAM(subdiv_rounds) = 16;
+int PARAM(subdiv_threads) = 4;
+int PARAM(subdiv_min_scale) = 1;
+
+SubDivGenerator::SubDivGenerator(int seed): TerrainGenerator(seed) {
+	// the thread calling generate_chunk does one of the slices itself
+	pool = new Pool(std::max(subdiv_threads - 1, 0));
+}
+
+SubDivGenerator::~SubDivGenerator() {
+	delete pool;
+}
+
+uint8 SubDivGenerator::decide(NodeView root, ivec3 position, int scale, bool refine) {
+	// each neighbour adds 2 if solid, 1 if it is still being refined, 0 if air.
+	// Outside of the chunk everything below is solid and everything above is air
+	int score = 0;
+	for (int x = -1; x <= 1; x ++) {
+		for (int y = -1; y <= 1; y ++) {
+			for (int z = -1; z <= 1; z ++) {
+				if (x == 0 and y == 0 and z == 0) continue;
+				ivec3 sidepos = position + ivec3(x,y,z) * scale;
+				if (!root.contains(IHitCube(sidepos, scale))) {
+					score += 1 - y;
+					continue;
+				}
+				NodeView sidenode = root.get_global(sidepos, scale);
+				if (sidenode.hasblock()) {
+					score += sidenode.block()->type == &blocktypes::stone ? 2 : 0;
+				} else if (!sidenode.haschildren()) {
+					score += 1;
 				}
 			}
 		}
+	}
+	
+	int threshold = 26 + int(uint(hash4(seed, position, scale)) % 13) - 6;
+	const int margin = 8;
+	if (refine and scale > subdiv_min_scale and std::abs(score - threshold) < margin) {
+		return child_refine;
+	}
+	return score >= threshold ? child_solid : child_air;
+}
 
-		if (score > node.scale * (hash4(seed, node.position, node.scale) % 15 + 5)) {
-			node.set_block(new Block(&blocktypes::dirt));
-		} else if (score > 0 and node.scale > min_scale_div) {
-			node.set_flag(Block::GENERATION_FLAG);
-		} else {
-			node.set_block(new Block(nullptr));
+void SubDivGenerator::decide_all(NodeView root, const vector<NodeView>& nodes, bool refine, vector<uint8>* decisions) {
+	int numchildren = refine ? BDIMS3 : 1;
+	decisions->resize(nodes.size() * numchildren);
+	
+	// only reads the tree, so the slices can run at the same time
+	auto decide_slice = [&] (int start, int end) {
+		for (int i = start; i < end; i ++) {
+			for (int j = 0; j < numchildren; j ++) {
+				int scale = nodes[i].scale / (refine ? BDIMS : 1);
+				ivec3 position = nodes[i].position + ivec3(NodeIndex(j)) * scale;
+				(*decisions)[i * numchildren + j] = decide(root, position, scale, refine);
+			}
 		}
+	};
+	
+	int numthreads = std::min<int>(subdiv_threads, nodes.size() / 64 + 1);
+	std::mutex lock;
+	std::condition_variable done;
+	int remaining = numthreads - 1;
+	for (int i = 1; i < numthreads; i ++) {
+		pool->pushJob([&, i] () {
+			decide_slice(nodes.size() * i / numthreads, nodes.size() * (i+1) / numthreads);
+			std::lock_guard guard(lock);
+			remaining --;
+			done.notify_all();
+		});
 	}
+	decide_slice(0, nodes.size() / numthreads);
 	
+	std::unique_lock guard(lock);
+	done.wait(guard, [&] () { return remaining == 0; });
+}
+
+void SubDivGenerator::generate_chunk(NodeView node, int depth) {
+	ASSERT(!node.haschildren());
+	GenerationStats genstats;
+	node.set_flag(Block::GENERATION_FLAG);
+	
+	vector<NodeView> flagged;
+	vector<NodeView> nodes;
+	vector<NodeView> unfinished;
+	vector<uint8> decisions;
+	int rounds = std::min(depth, subdiv_rounds);
 	
-	virtual void generate_chunk(NodeView node, int depth) {
-		node.set_flag(Block::GENERATION_FLAG);
-		cout << "GENERATING __________" << endl;
+	for (int round = 0; node.test_flag(Block::GENERATION_FLAG); round ++) {
+		flagged.clear();
+		nodes.clear();
+		for (NodeView curnode : node.iter<FlagNodeIter>(Block::GENERATION_FLAG)) {
+			flagged.push_back(curnode);
+			if (!curnode.haschildren() and !curnode.hasblock()) {
+				nodes.push_back(curnode);
+			}
+		}
+		for (NodeView& curnode : flagged) {
+			curnode.reset_flag(Block::GENERATION_FLAG);
+		}
 		
-		while (node.test_flag(Block::GENERATION_FLAG)) {
-			cout << node.haschildren() << ' ' << node.position << ' ' << node.scale << endl;
-			cout << "starting generation round " << endl;
-			for (NodePtr curnode : NodePtr(node).iter<NodeIter>()) {
-				cout << "brug" << endl;
-				if (curnode.hasblock() and curnode.block()->type == &blocktypes::dirt) {
-					cout << "bksdjflksd" << endl;
-					curnode.block()->type = &blocktypes::stone;
-				}
+		// the decisions are all made from the tree of the last round
+		// before any of them are applied, so the order does not matter.
+		// Once the rounds run out the nodes are filled instead of split
+		bool refine = round < rounds;
+		decide_all(node, nodes, refine, &decisions);
+		
+		for (int i = 0; i < nodes.size(); i ++) {
+			NodeView& curnode = nodes[i];
+			if (!refine) {
+				curnode.set_block(new Block(decisions[i] == child_solid ? &blocktypes::stone : nullptr));
+				genstats.leaves ++;
+				continue;
 			}
-			for (NodeView curnode : node.iter<FlagNodeIter>(Block::GENERATION_FLAG)) {
-				cout << node.position << ' ' << node.scale << endl;
-				curnode.reset_flag(Block::GENERATION_FLAG);
-				if (curnode.haschildren()) continue;
-				
-				cout << " splitting " << curnode.position << ' ' << curnode.scale << endl;
-				curnode.split();
-				for (NodeView curcurnode : curnode.iter<ChildIter>()) {
-					gen_node(curcurnode, depth);
+			curnode.split();
+			genstats.splits ++;
+			for (int j = 0; j < BDIMS3; j ++) {
+				uint8 decision = decisions[i * BDIMS3 + j];
+				if (decision == child_refine) {
+					curnode.child(j).set_flag(Block::GENERATION_FLAG);
+				} else {
+					curnode.child(j).set_block(new Block(decision == child_solid ? &blocktypes::stone : nullptr));
+					genstats.leaves ++;
 				}
 			}
 		}
+		// the nodes filled in the last round are unfinished, see
+		// TerrainGenerator::generate_chunk. They are flagged after the
+		// rounds end, as the flag is what keeps the rounds going
+		if (!refine) {
+			unfinished.swap(nodes);
+		}
 	}
-
-	virtual int get_height(ivec3 pos) {
-		return 0;
+	
+	for (NodeView& curnode : unfinished) {
+		curnode.set_flag(Block::GENERATION_FLAG);
 	}
-};
+	add_stats(genstats);
+}
 
-//EXPORT_PLUGIN(SubDivGenerator);
-*/
+void SubDivGenerator::gen_height_tile(HeightTile* tile) {
+	// the terrain depends on the chunk it is made in, so there are no heights
+	// that hold for every chunk. Structures are not placed with this generator
+	static std::once_flag warned;
+	std::call_once(warned, [] () {
+		std::cerr << "SubDivGenerator has no heights, so no structures are placed on it" << endl;
+	});
+	std::fill(tile->heights, tile->heights + HeightTile::size*HeightTile::size, height_min);
+}
 
 
 
@@ -984,3 +1555,271 @@ public:
 };
 
 EXPORT_PLUGIN(NullDecorator);
+
+
+
+
+int decoration_rank(BlockData* type) {
+	if (type == nullptr) {
+		return 0;
+	} else if (type == &blocktypes::leaves) {
+		return 1;
+	} else if (type == &blocktypes::wood) {
+		return 2;
+	}
+	return 3;
+}
+
+ScatterSampler::ScatterSampler(int seed, int spacing, int layer, int candidates, int rounds):
+seed(seed), spacing(spacing), layer(layer), candidates(candidates), rounds(rounds) {
+	
+}
+
+bool ScatterSampler::Candidate::beats(const Candidate& other) const {
+	// the position breaks ties, so two candidates never beat each other
+	return std::tie(priority, position.x, position.y) > std::tie(other.priority, other.position.x, other.position.y);
+}
+
+ScatterSampler::Candidate ScatterSampler::candidate(ivec2 cell, int index) const {
+	Candidate result;
+	result.position = cell * spacing + ivec2(
+		uint(hash4(seed, cell, index, layer*3)) % spacing,
+		uint(hash4(seed, cell, index, layer*3+1)) % spacing
+	);
+	result.priority = hash4(seed, cell, index, layer*3+2);
+	return result;
+}
+
+void ScatterSampler::points(ivec2 low, ivec2 high, vector<ivec2>* out) const {
+	// candidates closer than spacing are at most one cell away, so each
+	// round only looks at the cells next to a cell. The cells the rounds
+	// look at grow by one cell on each side for every round
+	ivec2 lowcell = safefloor(vec2(low) / float(spacing)) - rounds;
+	ivec2 highcell = safefloor(vec2(high - 1) / float(spacing)) + rounds;
+	ivec2 size = highcell - lowcell + 1;
+	
+	vector<Candidate> cells (size.x * size.y * candidates);
+	for (int x = 0; x < size.x; x ++) {
+		for (int y = 0; y < size.y; y ++) {
+			for (int i = 0; i < candidates; i ++) {
+				cells[(x * size.y + y) * candidates + i] = candidate(lowcell + ivec2(x,y), i);
+			}
+		}
+	}
+	
+	// each round keeps the candidates that beat all the undecided candidates
+	// near them, and removes the ones near a candidate that was kept before.
+	// The states of a round are all found from the states of the last round
+	vector<uint8> states (cells.size(), undecided);
+	vector<uint8> newstates (cells.size(), undecided);
+	for (int round = 1; round <= rounds; round ++) {
+		for (int x = round; x < size.x - round; x ++) {
+			for (int y = round; y < size.y - round; y ++) {
+				for (int i = 0; i < candidates; i ++) {
+					int index = (x * size.y + y) * candidates + i;
+					newstates[index] = states[index];
+					if (states[index] != undecided) continue;
+					
+					const Candidate& cand = cells[index];
+					bool blocked = false;
+					bool best = true;
+					for (int ox = x-1; ox <= x+1 and !blocked; ox ++) {
+						for (int oy = y-1; oy <= y+1 and !blocked; oy ++) {
+							for (int j = 0; j < candidates; j ++) {
+								int otherindex = (ox * size.y + oy) * candidates + j;
+								ivec2 dist = cells[otherindex].position - cand.position;
+								if (dist.x*dist.x + dist.y*dist.y >= spacing*spacing) continue;
+								if (states[otherindex] == kept) {
+									blocked = true;
+									break;
+								} else if (states[otherindex] == undecided and cells[otherindex].beats(cand)) {
+									best = false;
+								}
+							}
+						}
+					}
+					newstates[index] = blocked ? removed : (best ? kept : undecided);
+				}
+			}
+		}
+		states.swap(newstates);
+	}
+	
+	for (int x = rounds; x < size.x - rounds; x ++) {
+		for (int y = rounds; y < size.y - rounds; y ++) {
+			for (int i = 0; i < candidates; i ++) {
+				int index = (x * size.y + y) * candidates + i;
+				ivec2 pos = cells[index].position;
+				if (states[index] == kept and pos.x >= low.x and pos.y >= low.y and pos.x < high.x and pos.y < high.y) {
+					out->push_back(pos);
+				}
+			}
+		}
+	}
+}
+
+
+
+// structures are at least this far apart
+int PARAM(structure_spacing) = 6;
+float PARAM(tree_chance) = 0.3f;
+float PARAM(boulder_chance) = 0.05f;
+// chance of an ore vein in each 16^3 cube
+float PARAM(ore_chance) = 0.05f;
+
+// how far the blocks of a structure can be from its surface block, see
+// place_tree and place_boulder
+const int structure_reach = 3;
+const int structure_below = 3;
+const int structure_above = 10;
+// ore veins are in cubes of this size, and reach this far from their center
+const int ore_cellsize = 16;
+const int ore_reach = 2;
+
+// changes the block at pos to type if can_replace(oldtype) is true,
+// splitting up larger blocks if needed
+template <typename Func>
+static bool change_block(NodeView node, ivec3 pos, BlockData* type, Func can_replace) {
+	NodeView curnode = node.get_global(pos, 1);
+	if (!curnode.isvalid()) {
+		return false;
+	}
+	while (true) {
+		BlockData* curtype = curnode.hasblock() ? curnode.block()->type : nullptr;
+		if (!can_replace(curtype)) {
+			return false;
+		}
+		if (curnode.scale == 1) {
+			break;
+		}
+		curnode.subdivide();
+		curnode = curnode.child(NodeIndex((pos - curnode.position) / (curnode.scale / BDIMS)));
+	}
+	curnode.set_block(new Block(type));
+	return true;
+}
+
+void StructureDecorator::decorate_chunk(NodeView node) {
+	double start = getTime();
+	DecorationStats decstats;
+	decstats.chunks = 1;
+	
+	place_ores(node, &decstats);
+	
+	// the columns around the chunk are found too, for the structures that
+	// reach over the edge. The sampler gives the same points for them as
+	// it does for the chunks they are in
+	ivec2 low = ivec2(node.position.x, node.position.z);
+	ivec2 high = low + node.scale;
+	vector<ivec2> columns;
+	ScatterSampler sampler (seed, structure_spacing, 1);
+	sampler.points(low - structure_reach, high + structure_reach, &columns);
+	
+	vector<BlockWrite> writes;
+	for (ivec2 column : columns) {
+		int hash = hash4(seed, column, 0, 1);
+		ivec3 pos (column.x, 0, column.y);
+		pos.y = generator->get_height(pos);
+		if (pos.y + structure_above < node.position.y or pos.y - structure_below >= node.position.y + node.scale) {
+			continue;
+		}
+		
+		float choice = std::abs(randfloat(seed, column.x, column.y, 3, 1));
+		if (choice < tree_chance) {
+			place_tree(pos, hash, &writes);
+		} else if (choice < tree_chance + boulder_chance) {
+			place_boulder(pos, hash, &writes);
+		} else {
+			continue;
+		}
+		
+		if (node.contains(pos)) {
+			decstats.structures ++;
+		} else {
+			decstats.shared ++;
+		}
+	}
+	
+	for (const BlockWrite& write : writes) {
+		if (node.contains(write.position)) {
+			write_block(node, write, &decstats);
+		}
+	}
+	
+	decstats.time = getTime() - start;
+	add_stats(decstats);
+}
+
+void StructureDecorator::place_ores(NodeView node, DecorationStats* decstats) {
+	// veins from the cells next to the chunk can reach into it
+	ivec3 lowcell = safefloor(vec3(node.position - ore_reach) / float(ore_cellsize));
+	ivec3 highcell = safefloor(vec3(node.position + node.scale - 1 + ore_reach) / float(ore_cellsize));
+	for (int x = lowcell.x; x <= highcell.x; x ++) {
+		for (int y = lowcell.y; y <= highcell.y; y ++) {
+			for (int z = lowcell.z; z <= highcell.z; z ++) {
+				ivec3 cell (x,y,z);
+				if (std::abs(randfloat(seed, cell.x, cell.y, cell.z, 4)) >= ore_chance) {
+					continue;
+				}
+				int hash = hash4(seed, cell, 5);
+				BlockData* type = (uint(hash) % 4 == 0) ? &blocktypes::lightstone : &blocktypes::darkstone;
+				int radius = 1 + uint(hash) / 4 % 2;
+				ivec3 center = cell * ore_cellsize + ivec3(randvec3(seed, cell.x, cell.y, cell.z, 6) * float(ore_cellsize - 1));
+				
+				ivec3 low = glm::max(center - radius, node.position);
+				ivec3 high = glm::min(center + radius, node.position + node.scale - 1);
+				for (int px = low.x; px <= high.x; px ++) {
+					for (int py = low.y; py <= high.y; py ++) {
+						for (int pz = low.z; pz <= high.z; pz ++) {
+							ivec3 dist = ivec3(px,py,pz) - center;
+							if (dist.x*dist.x + dist.y*dist.y + dist.z*dist.z > radius*radius) continue;
+							decstats->writes += change_block(node, ivec3(px,py,pz), type, [] (BlockData* curtype) {
+								return curtype == &blocktypes::stone;
+							});
+						}
+					}
+				}
+			}
+		}
+	}
+}
+
+void StructureDecorator::place_tree(ivec3 pos, int hash, vector<BlockWrite>* writes) {
+	int height = 4 + uint(hash) % 4;
+	int radius = 2 + uint(hash) / 4 % 2;
+	for (int y = 0; y < height; y ++) {
+		writes->push_back({pos + ivec3(0,y,0), &blocktypes::wood});
+	}
+	ivec3 top = pos + ivec3(0,height,0);
+	for (int x = -radius; x <= radius; x ++) {
+		for (int y = -radius; y <= radius; y ++) {
+			for (int z = -radius; z <= radius; z ++) {
+				if (x*x + y*y + z*z <= radius*radius) {
+					writes->push_back({top + ivec3(x,y,z), &blocktypes::leaves});
+				}
+			}
+		}
+	}
+}
+
+void StructureDecorator::place_boulder(ivec3 pos, int hash, vector<BlockWrite>* writes) {
+	int radius = 1 + uint(hash) % 3;
+	for (int x = -radius; x <= radius; x ++) {
+		for (int y = -radius; y <= radius; y ++) {
+			for (int z = -radius; z <= radius; z ++) {
+				if (x*x + y*y + z*z <= radius*radius) {
+					writes->push_back({pos + ivec3(x,y,z), &blocktypes::stone});
+				}
+			}
+		}
+	}
+}
+
+void StructureDecorator::write_block(NodeView node, const BlockWrite& write, DecorationStats* decstats) {
+	int rank = decoration_rank(write.type);
+	decstats->writes += change_block(node, write.position, write.type, [rank] (BlockData* curtype) {
+		return decoration_rank(curtype) < rank;
+	});
+}
+
+EXPORT_PLUGIN(StructureDecorator);
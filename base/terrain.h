@@ -3,8 +3,15 @@
 
 #include "common.h"
 #include "plugins.h"
+#include "blocks.h"
 
 #include <random>
+#include <mutex>
+#include <memory>
+#include <list>
+#include <unordered_map>
+#include <map>
+#include <tuple>
 
 
 /*
@@ -56,28 +63,56 @@ vec2 randvec2(int seed, int a, int b, int c, int d);
 float perlin3d(int seed, float x, float y, float z);
 float perlin2d(int seed, float x, float y);
 
+// guaranteed bounds of the noise functions over a box, found with
+// interval arithmetic. The returned vector is (min, max)
+vec2 perlin3d_bounds(int seed, vec3 low, vec3 high);
+vec2 perlin2d_bounds(int seed, vec2 low, vec2 high);
+
 
 
 struct TerrainContext;
+class ClimateMap;
 struct TerrainValue;
 struct Layers;
-struct ShapeValue;
-struct BiomeResult;
 
 using LayerFunc = void (*) (TerrainContext* ctx, Layers* outlayers, vec3 pos);
-//using ShapeFunc = ShapeValue (*) (TerrainContext* ctx, const Layers* layers, vec3 pos);
 using ShapeFunc = TerrainValue (*) (const Layers* layers);
-using BiomeFunc = BiomeResult (*) (TerrainContext* ctx, const Layers* layers, ivec3 pos, int scale);
 
 TerrainValue default_falloff(const Layers* layers);
-
-
+void zero_layergen(TerrainContext* ctx, Layers* outlayers, vec3 pos);
+
+// when true, splitting is decided with the lower/upper bounds of the
+// shapes, otherwise the value and deriv are used. The bounds only leave a
+// node whole when no surface can be inside it, so the tree is the same as
+// checking every block. The value and deriv are a guess that can miss
+// small parts of surfaces, so the trees of the two modes are not the same
+extern bool interval_bounds;
+// whether the cave layer is generated
+extern bool cave_generation;
+// whether octaves smaller than the node are left out of fbm noise
+extern bool octave_culling;
+// whether temperature and humidity come from a ClimateMap
+extern bool climate_tiles;
+// the range of y values that heights are searched in
+extern int height_min;
+extern int height_max;
+
+
+// A value of a terrain function at a point. deriv is the max amount
+// the value changes over one unit, and lower/upper are guaranteed bounds
+// of the value over the whole cube being generated. The bounds are only
+// used when interval bounds are turned on (see TerrainContext::radius),
+// values made with only a deriv have infinite bounds
 struct TerrainValue {
 	float value = 0;
 	float deriv = 0;
+	float lower = 0;
+	float upper = 0;
 	
 	TerrainValue();
 	TerrainValue(float value, float deriv);
+	TerrainValue(float value, float deriv, float spread);
+	TerrainValue(float value, float deriv, float lower, float upper);
 	
 	TerrainValue operator+(const TerrainValue& other) const;
 	TerrainValue operator-(const TerrainValue& other) const;
@@ -102,6 +137,9 @@ struct TerrainValue {
 	bool operator<(const TerrainValue& other) const;
 	bool operator>(const TerrainValue& other) const;
 	
+	// if the surface of the shape could be inside a cube of this scale
+	bool needs_split(int scale) const;
+	
 	static TerrainValue lerp(const TerrainValue& val1, const TerrainValue& val2, float amount);
 	static TerrainValue min(const TerrainValue& val1, const TerrainValue& val2);
 	static TerrainValue max(const TerrainValue& val1, const TerrainValue& val2);
@@ -109,34 +147,34 @@ struct TerrainValue {
 };
 
 
-struct ShapeValue : protected TerrainValue {
-	using TerrainValue::value;
-	using TerrainValue::deriv;
-	LayerFunc layergen;
-	BlockData* btype;
-	BiomeFunc biome;
-	ShapeFunc falloff;
-	
-	ShapeValue() {}
-	ShapeValue(const TerrainValue& terrvalue, BlockData* btype, LayerFunc layergen = nullptr, BiomeFunc biome = nullptr);
-	ShapeValue(const TerrainValue& terrvalue, ShapeFunc func, BlockData* btype, LayerFunc layergen = nullptr, BiomeFunc biome = nullptr);
-	//ShapeValue(ShapeFunc func, BlockData* btype, LayerFunc layergen = nullptr, BiomeFunc biome = nullptr);
-	
-	bool operator<(const ShapeValue& other) const;
-	bool operator>(const ShapeValue& other) const;
-	
-	BlockData* blocktype(int scale);
-	bool needs_split(int scale);
-};
-
-
 struct TerrainContext {
 	int seed;
 	ShapeFunc falloff;
+	// half the size of the cube being generated, values are bounded
+	// over this cube. When zero, only the value at the point is found
+	float radius = 0;
+	// size of the cube being generated, detail smaller than
+	// this can be skipped. Zero when sampling a single point
+	float scale = 0;
+	// false when a parent node was shown to have no caves,
+	// so the cave layer does not have to be found
+	bool caves = true;
+	// when set, the climate is read from the map instead of the noise
+	ClimateMap* climate = nullptr;
+	// nodes of this size are not split, even if a surface could be inside
+	// them, so chunks are only generated to the depth they are asked for
+	int min_scale = 1;
 };
 
+// noise with its bounds over the cube of the context. Height is the
+// range of the values, and layer offsets the seed
+TerrainValue perlin2d(TerrainContext* ctx, vec3 pos, int scale, int height, int layer = 0);
+TerrainValue perlin3d(TerrainContext* ctx, vec3 pos, int scale, int height, int layer = 0);
+TerrainValue fbm2d(TerrainContext* ctx, vec3 pos, int scale, int height, int octaves, int layer = 0);
+TerrainValue fbm3d(TerrainContext* ctx, vec3 pos, int scale, int height, int octaves, int layer = 0);
+
 struct Layers {
-	static constexpr int num_layers = 8;
+	static constexpr int num_layers = 9;
 
     TerrainValue temperature;
     TerrainValue temperature_variance;
@@ -147,6 +185,8 @@ struct Layers {
     TerrainValue ground_level;
     TerrainValue water_table;
     TerrainValue stone_level;
+    // below zero inside of caves
+    TerrainValue caves;
 
 	TerrainValue* layers() {
 		return (TerrainValue*)this;
@@ -154,16 +194,6 @@ struct Layers {
 };
 
 
-struct BiomeResult {
-	LayerFunc nextlayergen;
-	BiomeFunc nextbiome;
-	BlockData* blocktype;
-	ShapeFunc falloff;
-	bool needs_split;
-};
-
-
-
 struct LerpLayerGen {
 	vec3 position;
 	float scale;
@@ -172,8 +202,20 @@ struct LerpLayerGen {
 	} samples[8];
 	float max_deriv[Layers::num_layers];
 	
-	LerpLayerGen(TerrainContext* ctx, LayerFunc shape, vec3 samplepos, float scale);
-	void add_value(Layers* layers, vec3 pos);
+	// the samples are of shape added on top of prevlayergen, if there is one.
+	// They are only taken when the first value is added, so a node that moves
+	// to another biome and is filled without being split never takes them
+	LerpLayerGen(TerrainContext* ctx, LayerFunc shape, vec3 samplepos, float scale, LerpLayerGen* prevlayergen = nullptr);
+	void add_value(Layers* layers, vec3 pos, float radius = 0);
+	bool has_samples() const;
+	
+private:
+	TerrainContext pointctx;
+	LayerFunc shape;
+	LerpLayerGen* prevlayergen;
+	bool sampled = false;
+	
+	void sample();
 };
 
 
@@ -182,6 +224,108 @@ struct LerpLayerGen {
 
 
 
+// counts of the work done while generating, used to
+// compare the cost of different generation settings
+struct GenerationStats {
+	int64 splits = 0;
+	int64 joins = 0;
+	int64 leaves = 0;
+	// nodes that moved to another biome, keeping their layers, and
+	// how many of those had to sample the lerp of the biome for children
+	int64 hops = 0;
+	int64 hop_samples = 0;
+	
+	GenerationStats& operator+=(const GenerationStats& other);
+};
+
+// a square of the heightmap. Heights are the y of the top of the
+// highest solid block in each column, or height_min if there is none
+struct HeightTile {
+	static constexpr int size = 64;
+	ivec2 position;
+	// indexed as x*size + z
+	int heights[size*size];
+};
+
+// stands in for a NodeView when only the heights of the terrain are
+// needed. Children are given from the top down, and nodes that are
+// below the heights already found are skipped
+struct HeightNode {
+	ivec3 position;
+	int scale;
+	HeightTile* tile;
+	
+	HeightNode child(NodeIndex index) const;
+	void split() {}
+	void join() {}
+	// true if every column in the node already has a higher height
+	bool skip() const;
+	void set_type(BlockData* type);
+};
+
+// stands in for a NodeView when the terrain is written straight to the
+// pre-order stream of SequentialFileFormat, so no nodes or blocks are made
+struct StreamNode {
+	ivec3 position;
+	int scale;
+	string* out;
+	
+	StreamNode child(NodeIndex index) const;
+	void split();
+	// the children are all single leaves at the end
+	// of the stream, so they are replaced by one
+	void join();
+	void set_type(BlockData* type);
+};
+
+// lru cache of tiles keyed by their position, shared between threads
+template <typename Tile>
+class TileCache {
+public:
+	TileCache(int capacity);
+	
+	std::shared_ptr<const Tile> find(ivec2 position);
+	void add(std::shared_ptr<const Tile> tile);
+	
+private:
+	int capacity;
+	std::mutex lock;
+	std::list<std::shared_ptr<const Tile>> tiles;
+	std::unordered_map<uint64,typename std::list<std::shared_ptr<const Tile>>::iterator> index;
+	
+	static uint64 key(ivec2 position);
+};
+
+using HeightCache = TileCache<HeightTile>;
+
+// temperature and humidity vary over hundreds of blocks, so they are
+// sampled on a coarse grid, made lazily a tile at a time
+struct ClimateTile {
+	// cells along each side, and blocks between samples
+	static constexpr int size = 16;
+	static constexpr int spacing = 16;
+	static constexpr int samples = size + 1;
+	ivec2 position;
+	// indexed as x*samples + z
+	float temperature[samples*samples];
+	float humidity[samples*samples];
+};
+
+class ClimateMap {
+public:
+	ClimateMap(int seed);
+	
+	// adds the temperature and humidity at pos, interpolated between the
+	// samples, with bounds over the cube of the context
+	void add_climate(TerrainContext* ctx, Layers* layers, vec3 pos);
+	
+private:
+	int seed;
+	TileCache<ClimateTile> cache;
+	
+	std::shared_ptr<const ClimateTile> get_tile(ivec2 position);
+};
+
 class TerrainGenerator {
 	BASE_PLUGIN(TerrainGenerator, (int seed));
 public:
@@ -190,43 +334,193 @@ public:
 	TerrainGenerator(int seed);
 	virtual ~TerrainGenerator() {}
 	
+	// generates the chunk down to nodes of depth_scale(node.scale, depth).
+	// Nodes of that size that a surface could still be inside are filled
+	// with the block at their center and given the generation flag, to
+	// show where more detail is missing. The node can't have children, so
+	// to generate it again in more detail it has to be joined first
+	// (GenerationCache::generate_chunk does this)
 	virtual void generate_chunk(NodeView node, int depth) = 0;
-	virtual int get_height(ivec3 pos) = 0;
+	// fills in the heights of the tile, matching the terrain from generate_chunk
+	virtual void gen_height_tile(HeightTile* tile) = 0;
+	// appends the chunk to out in the format of SequentialFileFormat. By
+	// default the chunk is generated and then saved, generators should
+	// write the stream directly if they can
+	virtual void generate_stream(ivec3 position, int scale, int depth, string* out);
+	
+	// y of the top of the highest solid block in the column at pos.x, pos.z
+	virtual int get_height(ivec3 pos);
+	// heights of a rectangle of columns, stored as heights[x*size.y + z]
+	virtual void get_heights(ivec2 start, ivec2 size, int* heights);
+	
+	// changed whenever the terrain made by the generator changes,
+	// so terrain cached by older versions is not used
+	virtual int version();
+	// hash of any settings of the generator that change its terrain,
+	// generators with their own settings should add them to this one
+	virtual uint64 fingerprint();
+	
+	// size of the smallest nodes of a chunk of the scale generated to depth
+	static int depth_scale(int scale, int depth);
+	// the depth that generates a chunk of the scale down to single blocks
+	static int full_depth(int scale);
+	
+	// totals of the stats of all chunks generated so far
+	GenerationStats get_stats();
+	void add_stats(const GenerationStats& newstats);
+	
+protected:
+	std::mutex stats_lock;
+	GenerationStats stats;
+	HeightCache heightcache;
+	ClimateMap climate;
+	
+	std::shared_ptr<const HeightTile> get_height_tile(ivec2 position);
+	static uint64 hash_setting(uint64 hash, int value);
 };
 
+// Generates terrain by refining the octree in rounds, like a cellular
+// automaton. Each round splits every node with the generation flag and
+// decides its children from their neighbours in the tree of the last round,
+// so all the children of a round can be decided in parallel.
+// Outside of the chunk everything below is taken to be solid and everything
+// above to be air, so the terrain depends on the chunks it is made in and
+// does not line up at their borders. For the same reason it has no heights,
+// and decorators that need them place nothing on it
+class SubDivGenerator : public TerrainGenerator {
+	PLUGIN(SubDivGenerator);
+public:
+	SubDivGenerator(int seed);
+	virtual ~SubDivGenerator();
+	
+	// depth limits the number of rounds, along with subdiv_rounds
+	virtual void generate_chunk(NodeView node, int depth);
+	virtual void gen_height_tile(HeightTile* tile);
+	
+protected:
+	enum : uint8 {
+		child_air,
+		child_solid,
+		child_refine,
+	};
+	
+	uint8 decide(NodeView root, ivec3 position, int scale, bool refine);
+	// decides the children of all the nodes, or the nodes themselves
+	// if refine is false, spread over subdiv_threads threads
+	void decide_all(NodeView root, const vector<NodeView>& nodes, bool refine, vector<uint8>* decisions);
+	
+	// runs the slices of decide_all, and is shared by all
+	// the chunks that are generated at the same time
+	Pool* pool;
+};
+
+// counts of the work done while decorating
+struct DecorationStats {
+	int64 chunks = 0;
+	// structures whose column is in the chunk
+	int64 structures = 0;
+	int64 writes = 0;
+	// structures of columns outside the chunk that reach into it
+	int64 shared = 0;
+	double time = 0;
+	
+	DecorationStats& operator+=(const DecorationStats& other);
+};
+
+// Adds objects to the terrain after it is generated, like trees and
+// structures. Chunks can be decorated in parallel, so a decorator
+// should only change the chunk it is given
 class TerrainDecorator {
-	BASE_PLUGIN(TerrainDecorator, (int seed));
+	BASE_PLUGIN(TerrainDecorator, (TerrainGenerator* generator));
 public:
 	int seed;
+	TerrainGenerator* generator;
 	
-	TerrainDecorator(int nseed);
+	TerrainDecorator(TerrainGenerator* generator);
 	virtual ~TerrainDecorator() {}
 	
+	// decorates a newly generated chunk. The chunk has to end up the same
+	// whether or not its neighbours are decorated, so chunks can be saved
+	// and loaded on their own
 	virtual void decorate_chunk(NodeView node) = 0;
+	
+	// totals of all chunks decorated so far
+	DecorationStats get_stats();
+	void add_stats(const DecorationStats& newstats);
+	
+protected:
+	std::mutex stats_lock;
+	DecorationStats stats;
 };
 
 
-
-
-
-
-
-
-
-
-struct BiomeGenerator : public TerrainGenerator {
-	PLUGIN(BiomeGenerator);
-	using TerrainGenerator::TerrainGenerator;
-	static BiomeFunc root_biome;
-	static LayerFunc root_layergen;
+// Well spaced random columns (blue noise) for placing things like trees.
+// Each cell of a grid the size of spacing has a few candidate points from
+// hash4, each with a random priority. In each round, a candidate is kept if it
+// beats all the undecided candidates closer than spacing, and removed if it is
+// closer than spacing to a kept one. So the kept points are always at least
+// spacing apart, and a point only depends on the cells within rounds cells
+// of it, so regions that are found separately agree at their borders
+class ScatterSampler {
+public:
+	// layer gives a different set of points for the same seed. More
+	// rounds fill in more of the gaps between the points
+	ScatterSampler(int seed, int spacing, int layer = 0, int candidates = 2, int rounds = 3);
 	
-	virtual void generate_chunk(NodeView node, int depth);
-	virtual int get_height(ivec3 pos);
-	BlockData* gen_node(NodeView node, LerpLayerGen* prevlayergen, LayerFunc layergen, BiomeFunc biome, int depth, ShapeFunc falloff);
+	// adds the points with low <= point < high to out, as (x,z) columns
+	void points(ivec2 low, ivec2 high, vector<ivec2>* out) const;
+	
+private:
+	int seed;
+	int spacing;
+	int layer;
+	int candidates;
+	int rounds;
+	
+	enum : uint8 {
+		undecided,
+		kept,
+		removed,
+	};
+	
+	struct Candidate {
+		ivec2 position;
+		uint priority;
+		
+		bool beats(const Candidate& other) const;
+	};
+	
+	Candidate candidate(ivec2 cell, int index) const;
 };
 
+// a block placed by a decorator. The block is only changed if the
+// new type has a higher rank than the old one (see decoration_rank),
+// so the order that writes are done in does not matter
+struct BlockWrite {
+	ivec3 position;
+	BlockData* type;
+};
 
+int decoration_rank(BlockData* type);
 
+// Places trees and boulders on the surface, and ores in stone. Each chunk
+// finds every structure that could reach into it, from the columns and ore
+// cells around it as well as its own, and only writes the blocks inside of
+// it. So nothing is passed between chunks, and a chunk gets the same blocks
+// whatever order its neighbours are decorated in, or if they never are
+class StructureDecorator : public TerrainDecorator {
+	PLUGIN(StructureDecorator);
+public:
+	using TerrainDecorator::TerrainDecorator;
+	
+	virtual void decorate_chunk(NodeView node);
+	
+protected:
+	void place_ores(NodeView node, DecorationStats* decstats);
+	void place_tree(ivec3 pos, int hash, vector<BlockWrite>* writes);
+	void place_boulder(ivec3 pos, int hash, vector<BlockWrite>* writes);
+	void write_block(NodeView node, const BlockWrite& write, DecorationStats* decstats);
+};
 
 
 
@@ -237,24 +531,134 @@ struct BiomeGenerator : public TerrainGenerator {
 
 
 
+// Biome graphs are described with types, so the whole graph can be
+// inlined into the generator. A biome is a struct with a layergen that
+// adds to the layers, and a list of shapes:
+//
+// struct PlainsBiome {
+// 	static constexpr LayerFunc layergen = plains_layergen;
+// 	using shapes = ShapeList<
+// 		SolidShape<layer_value<&Layers::stone_level>, &blocktypes::stone>,
+// 		SolidShape<layer_value<&Layers::ground_level>, &blocktypes::grass>
+// 	>;
+// };
+//
+// The shapes are checked in order, and the first one that contains the node
+// (value below zero) is used. If the surface of a shape could be in the node,
+// the node is split instead. Nodes outside of all the shapes are air.
+
+// fills the inside of the shape with a block
+template <ShapeFunc func, BlockData* btype>
+struct SolidShape {
+	static constexpr ShapeFunc shape = func;
+};
 
+// moves to another biome inside of the shape. The shape
+// is used as the falloff of the new biome
+template <ShapeFunc func, typename Biome>
+struct BiomeShape {
+	static constexpr ShapeFunc shape = func;
+};
 
+template <typename ... Shapes>
+struct ShapeList {
+	static constexpr int size = sizeof...(Shapes);
+};
 
+template <TerrainValue Layers::* layer>
+TerrainValue layer_value(const Layers* layers) {
+	return layers->*layer;
+}
 
 
+inline void set_leaf(NodeView node, BlockData* type) {
+	node.set_block(new Block(type));
+}
 
+inline void set_leaf(HeightNode node, BlockData* type) {
+	node.set_type(type);
+}
 
+inline bool skip_node(NodeView node) {
+	return false;
+}
 
+inline bool skip_node(HeightNode node) {
+	return node.skip();
+}
 
+inline void set_leaf(StreamNode node, BlockData* type) {
+	node.set_type(type);
+}
 
+inline bool skip_node(StreamNode node) {
+	return false;
+}
 
+// the node was filled without knowing if a surface is inside it, only
+// octrees keep track of this, so the node can be generated again later
+inline void set_unfinished(NodeView node) {
+	node.set_flag(Block::GENERATION_FLAG);
+}
 
+inline void set_unfinished(HeightNode node) {}
+inline void set_unfinished(StreamNode node) {}
 
 
+// Generates terrain from a biome graph. The graph is walked in the same way
+// for octrees (NodeView) and for heightmaps (HeightNode)
+template <typename RootBiome>
+struct BiomeGraphGenerator : public TerrainGenerator {
+	using TerrainGenerator::TerrainGenerator;
+	
+	virtual void generate_chunk(NodeView node, int depth);
+	virtual void gen_height_tile(HeightTile* tile);
+	virtual void generate_stream(ivec3 position, int scale, int depth, string* out);
+	virtual uint64 fingerprint();
+	
+	// nodelayers are the layers already found for this node by the last biome,
+	// when it moved to this one, otherwise they come from prevlayergen
+	template <typename Biome, typename NodeT>
+	BlockData* gen_node(NodeT node, LerpLayerGen* prevlayergen, ShapeFunc falloff, bool caves, int min_scale,
+		GenerationStats* genstats, const Layers* nodelayers = nullptr);
+	
+	template <typename Biome, typename NodeT, typename Shape, typename ... Shapes>
+	BlockData* gen_shapes(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, ShapeList<Shape,Shapes...> shapes);
+	template <typename Biome, typename NodeT>
+	BlockData* gen_shapes(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, ShapeList<> shapes);
+	
+	template <typename Biome, typename NodeT, ShapeFunc func, BlockData* btype>
+	BlockData* gen_inside(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, SolidShape<func,btype> shape);
+	template <typename Biome, typename NodeT, ShapeFunc func, typename NextBiome>
+	BlockData* gen_inside(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, BiomeShape<func,NextBiome> shape);
+	
+	template <typename Biome, typename NodeT>
+	BlockData* split_node(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx, GenerationStats* genstats);
+};
 
 
+struct RootBiome;
+struct ClimateRootBiome;
 
+struct BiomeGenerator : public BiomeGraphGenerator<RootBiome> {
+	PLUGIN(BiomeGenerator);
+	using BiomeGraphGenerator::BiomeGraphGenerator;
+	
+	virtual int version();
+};
 
+// the same terrain as BiomeGenerator, with mountains where it is
+// hot and plains where it is cold, chosen by the climate
+struct ClimateBiomeGenerator : public BiomeGraphGenerator<ClimateRootBiome> {
+	PLUGIN(ClimateBiomeGenerator);
+	using BiomeGraphGenerator::BiomeGraphGenerator;
+	
+	virtual int version();
+};
 
 /*
 struct TerrainContext {
@@ -347,8 +751,207 @@ struct ShapeResolver : public TerrainGenerator {
 
 
 
+template <typename Tile>
+TileCache<Tile>::TileCache(int newcapacity): capacity(newcapacity) {
+	
+}
 
+template <typename Tile>
+uint64 TileCache<Tile>::key(ivec2 position) {
+	return (uint64(uint32(position.x)) << 32) | uint32(position.y);
+}
 
+template <typename Tile>
+std::shared_ptr<const Tile> TileCache<Tile>::find(ivec2 position) {
+	std::lock_guard guard(lock);
+	auto iter = index.find(key(position));
+	if (iter == index.end()) {
+		return nullptr;
+	}
+	tiles.splice(tiles.begin(), tiles, iter->second);
+	return *iter->second;
+}
+
+template <typename Tile>
+void TileCache<Tile>::add(std::shared_ptr<const Tile> tile) {
+	std::lock_guard guard(lock);
+	uint64 tilekey = key(tile->position);
+	if (index.count(tilekey)) {
+		return;
+	}
+	tiles.push_front(tile);
+	index[tilekey] = tiles.begin();
+	while (tiles.size() > capacity) {
+		index.erase(key(tiles.back()->position));
+		tiles.pop_back();
+	}
+}
+
+
+
+template <typename RootBiome>
+void BiomeGraphGenerator<RootBiome>::generate_chunk(NodeView node, int depth) {
+	TerrainContext context;
+	context.seed = seed;
+	context.falloff = default_falloff;
+	context.climate = climate_tiles ? &climate : nullptr;
+	LerpLayerGen initial_gen (&context, zero_layergen, node.position, node.scale);
+	GenerationStats genstats;
+	ASSERT(!node.haschildren());
+	gen_node<RootBiome>(node, &initial_gen, default_falloff, cave_generation, depth_scale(node.scale, depth), &genstats);
+	add_stats(genstats);
+}
+
+template <typename RootBiome>
+void BiomeGraphGenerator<RootBiome>::gen_height_tile(HeightTile* tile) {
+	std::fill(tile->heights, tile->heights + HeightTile::size*HeightTile::size, height_min);
+	TerrainContext context;
+	context.seed = seed;
+	context.falloff = default_falloff;
+	context.climate = climate_tiles ? &climate : nullptr;
+	GenerationStats genstats;
+	
+	for (int y = height_max - HeightTile::size; y >= height_min; y -= HeightTile::size) {
+		HeightNode node {ivec3(tile->position.x, y, tile->position.y), HeightTile::size, tile};
+		if (node.skip()) {
+			break;
+		}
+		LerpLayerGen initial_gen (&context, zero_layergen, node.position, node.scale);
+		gen_node<RootBiome>(node, &initial_gen, default_falloff, cave_generation, 1, &genstats);
+	}
+}
+
+template <typename RootBiome>
+uint64 BiomeGraphGenerator<RootBiome>::fingerprint() {
+	uint64 hash = TerrainGenerator::fingerprint();
+	hash = hash_setting(hash, cave_generation);
+	hash = hash_setting(hash, climate_tiles);
+	hash = hash_setting(hash, height_min);
+	hash = hash_setting(hash, height_max);
+	return hash;
+}
+
+template <typename RootBiome>
+void BiomeGraphGenerator<RootBiome>::generate_stream(ivec3 position, int scale, int depth, string* out) {
+	TerrainContext context;
+	context.seed = seed;
+	context.falloff = default_falloff;
+	context.climate = climate_tiles ? &climate : nullptr;
+	LerpLayerGen initial_gen (&context, zero_layergen, position, scale);
+	GenerationStats genstats;
+	gen_node<RootBiome>(StreamNode {position, scale, out}, &initial_gen, default_falloff, cave_generation,
+		depth_scale(scale, depth), &genstats);
+	add_stats(genstats);
+}
+
+template <typename RootBiome>
+template <typename Biome, typename NodeT>
+BlockData* BiomeGraphGenerator<RootBiome>::gen_node(NodeT node, LerpLayerGen* prevlayergen, ShapeFunc falloff, bool caves, int min_scale,
+		GenerationStats* genstats, const Layers* nodelayers) {
+	if (skip_node(node)) {
+		return BLOCK_NULL;
+	}
+	
+	vec3 pos = vec3(node.position) + float(node.scale)/2;
+	TerrainContext context;
+	context.seed = seed;
+	context.falloff = falloff;
+	context.climate = climate_tiles ? &climate : nullptr;
+	// single blocks are never split, so their bounds are not needed
+	context.radius = (interval_bounds and node.scale > 1) ? node.scale / 2.0f : 0;
+	context.scale = node.scale;
+	context.caves = caves;
+	context.min_scale = min_scale;
+	
+	Layers layers;
+	if (nodelayers != nullptr) {
+		layers = *nodelayers;
+	} else {
+		prevlayergen->add_value(&layers, pos, context.radius);
+	}
+	Biome::layergen(&context, &layers, pos);
+	// if there are no caves anywhere in this node, the children skip them
+	context.caves = caves and layers.caves.lower <= 0;
+	
+	return gen_shapes<Biome>(node, prevlayergen, &context, &layers, genstats, typename Biome::shapes());
+}
+
+template <typename RootBiome>
+template <typename Biome, typename NodeT, typename Shape, typename ... Shapes>
+BlockData* BiomeGraphGenerator<RootBiome>::gen_shapes(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, ShapeList<Shape,Shapes...> shapes) {
+	TerrainValue value = Shape::shape(layers);
+	if (value.needs_split(node.scale) and node.scale > ctx->min_scale) {
+		return split_node<Biome>(node, prevlayergen, ctx, genstats);
+	} else if (value.needs_split(node.scale)) {
+		// too small to split at this depth, so the block at the center is
+		// used. BLOCK_SPLIT keeps the parent from joining it with the others,
+		// so only nodes of min_scale are ever unfinished
+		if (value.value < 0) {
+			gen_inside<Biome>(node, prevlayergen, ctx, layers, genstats, Shape());
+		} else {
+			gen_shapes<Biome>(node, prevlayergen, ctx, layers, genstats, ShapeList<Shapes...>());
+		}
+		set_unfinished(node);
+		return BLOCK_SPLIT;
+	} else if (value.value < 0) {
+		return gen_inside<Biome>(node, prevlayergen, ctx, layers, genstats, Shape());
+	}
+	return gen_shapes<Biome>(node, prevlayergen, ctx, layers, genstats, ShapeList<Shapes...>());
+}
+
+template <typename RootBiome>
+template <typename Biome, typename NodeT>
+BlockData* BiomeGraphGenerator<RootBiome>::gen_shapes(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, ShapeList<> shapes) {
+	set_leaf(node, nullptr);
+	genstats->leaves ++;
+	return nullptr;
+}
 
+template <typename RootBiome>
+template <typename Biome, typename NodeT, ShapeFunc func, BlockData* btype>
+BlockData* BiomeGraphGenerator<RootBiome>::gen_inside(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, SolidShape<func,btype> shape) {
+	set_leaf(node, btype);
+	genstats->leaves ++;
+	return btype;
+}
+
+template <typename RootBiome>
+template <typename Biome, typename NodeT, ShapeFunc func, typename NextBiome>
+BlockData* BiomeGraphGenerator<RootBiome>::gen_inside(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx,
+		const Layers* layers, GenerationStats* genstats, BiomeShape<func,NextBiome> shape) {
+	// the layers of this node are passed on as they are, the lerp
+	// is only sampled if the next biome splits the node
+	LerpLayerGen lerplayergen (ctx, Biome::layergen, node.position, node.scale, prevlayergen);
+	BlockData* blocktype = gen_node<NextBiome>(node, &lerplayergen, func, ctx->caves, ctx->min_scale, genstats, layers);
+	genstats->hops ++;
+	genstats->hop_samples += lerplayergen.has_samples();
+	return blocktype;
+}
+
+template <typename RootBiome>
+template <typename Biome, typename NodeT>
+BlockData* BiomeGraphGenerator<RootBiome>::split_node(NodeT node, LerpLayerGen* prevlayergen, TerrainContext* ctx, GenerationStats* genstats) {
+	// only leaves are split, split() would delete the children as a block
+	node.split();
+	genstats->splits ++;
+	
+	BlockData* blocktype = gen_node<Biome>(node.child(0), prevlayergen, ctx->falloff, ctx->caves, ctx->min_scale, genstats);
+	for (int i = 1; i < BDIMS3; i ++) {
+		BlockData* newtype = gen_node<Biome>(node.child(i), prevlayergen, ctx->falloff, ctx->caves, ctx->min_scale, genstats);
+		blocktype = (newtype == blocktype) ? blocktype : BLOCK_SPLIT;
+	}
+	
+	if (blocktype != BLOCK_SPLIT) {
+		node.join();
+		set_leaf(node, blocktype);
+		genstats->joins ++;
+		genstats->leaves -= BDIMS3 - 1;
+	}
+	
+	return blocktype;
+}
 
 #endif
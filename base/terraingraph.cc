@@ -0,0 +1,723 @@
+#include "terraingraph.h"
+
+#include "blocks.h"
+#include "blockdata.h"
+
+#include <fstream>
+#include <sstream>
+#include <map>
+#include <cstdlib>
+#include <cctype>
+
+string PARAM(terrain_graph) = string("terrain/default.txt");
+
+
+TerrainValue ValueBatch::get(int lane) const {
+	return TerrainValue(value[lane], deriv[lane], lower[lane], upper[lane]);
+}
+
+void ValueBatch::set(int lane, const TerrainValue& val) {
+	value[lane] = val.value;
+	deriv[lane] = val.deriv;
+	lower[lane] = val.lower;
+	upper[lane] = val.upper;
+}
+
+
+
+// names of the layers, in the same order as the Layers struct.
+// Layers that are read before they are added to start at zero
+static const char* layer_names[] = {
+	"temperature", "temperature_variance", "humidity", "humidity_variance", "ruggedness",
+	"ground_level", "water_table", "stone_level", "caves",
+};
+static_assert(sizeof(layer_names) / sizeof(layer_names[0]) == Layers::num_layers);
+
+static const std::map<string,BlockData*> block_names = {
+	{"air", nullptr},
+	{"dirt", &blocktypes::dirt},
+	{"grass", &blocktypes::grass},
+	{"stone", &blocktypes::stone},
+	{"wood", &blocktypes::wood},
+	{"snow", &blocktypes::snow},
+	{"leaves", &blocktypes::leaves},
+	{"lightstone", &blocktypes::lightstone},
+	{"darkstone", &blocktypes::darkstone},
+};
+
+// recursive descent parser of one line of the file. The parse
+// functions return the register of the value, or -1 on an error
+struct GraphParser {
+	vector<GraphInstr>* program;
+	std::map<string,int>* names;
+	string line;
+	int pos = 0;
+	string error;
+
+	int emit(GraphInstr instr) {
+		program->push_back(instr);
+		return program->size() - 1;
+	}
+
+	bool is_constant(int reg) {
+		return (*program)[reg].op == GraphOp::constant;
+	}
+
+	float constant(int reg) {
+		return (*program)[reg].constant;
+	}
+
+	int fail(string message) {
+		if (error.empty()) {
+			error = message;
+		}
+		return -1;
+	}
+
+	void skip_space() {
+		while (pos < line.size() and std::isspace(line[pos])) {
+			pos ++;
+		}
+	}
+
+	bool accept(char c) {
+		skip_space();
+		if (pos < line.size() and line[pos] == c) {
+			pos ++;
+			return true;
+		}
+		return false;
+	}
+
+	bool at_end() {
+		skip_space();
+		return pos >= line.size() or line[pos] == '#';
+	}
+
+	string read_name() {
+		skip_space();
+		int start = pos;
+		while (pos < line.size() and (std::isalnum(line[pos]) or line[pos] == '_')) {
+			pos ++;
+		}
+		return line.substr(start, pos - start);
+	}
+
+	bool read_number(float* result) {
+		skip_space();
+		const char* start = line.c_str() + pos;
+		char* end;
+		*result = std::strtof(start, &end);
+		pos += end - start;
+		return end != start;
+	}
+
+	int read_int_arg(int* result, bool last) {
+		float value;
+		if (!read_number(&value) or value != int(value)) {
+			return fail("expected a whole number");
+		}
+		*result = value;
+		if (!accept(last ? ')' : ',')) {
+			return fail(last ? "expected ')'" : "expected ','");
+		}
+		return 0;
+	}
+
+	int lookup(string name) {
+		if (name == "x" or name == "y" or name == "z") {
+			GraphInstr instr;
+			instr.op = name == "x" ? GraphOp::posx : name == "y" ? GraphOp::posy : GraphOp::posz;
+			return emit(instr);
+		}
+		auto iter = names->find(name);
+		if (iter != names->end()) {
+			return iter->second;
+		}
+		for (const char* layer : layer_names) {
+			if (name == layer) {
+				GraphInstr instr;
+				instr.op = GraphOp::constant;
+				return (*names)[name] = emit(instr);
+			}
+		}
+		return fail("unknown name '" + name + "'");
+	}
+
+	int binary(GraphOp op, int arg1, int arg2) {
+		if (arg1 == -1 or arg2 == -1) {
+			return -1;
+		}
+		GraphInstr instr;
+		instr.op = op;
+		instr.arg1 = arg1;
+		instr.arg2 = arg2;
+		return emit(instr);
+	}
+
+	int with_constant(GraphOp op, int arg, float value) {
+		GraphInstr instr;
+		instr.op = op;
+		instr.arg1 = arg;
+		instr.constant = value;
+		return emit(instr);
+	}
+
+	int call(string name) {
+		GraphInstr instr;
+		if (name == "perlin2d" or name == "perlin3d" or name == "fbm2d" or name == "fbm3d") {
+			bool fbm = name[0] == 'f';
+			instr.op = name == "perlin2d" ? GraphOp::perlin2d : name == "perlin3d" ? GraphOp::perlin3d
+				: name == "fbm2d" ? GraphOp::fbm2d : GraphOp::fbm3d;
+			if (read_int_arg(&instr.scale, false) == -1 or read_int_arg(&instr.height, false) == -1
+					or (fbm and read_int_arg(&instr.octaves, false) == -1)
+					or read_int_arg(&instr.layer, true) == -1) {
+				return -1;
+			}
+			if (instr.scale <= 0) {
+				return fail("noise scale has to be positive");
+			}
+			return emit(instr);
+		} else if (name == "abs") {
+			instr.op = GraphOp::abs;
+			instr.arg1 = expr();
+			if (instr.arg1 == -1 or !accept(')')) {
+				return fail("expected ')'");
+			}
+			return emit(instr);
+		} else if (name == "min" or name == "max") {
+			int arg1 = expr();
+			if (arg1 == -1 or !accept(',')) {
+				return fail("expected ','");
+			}
+			int arg2 = expr();
+			if (arg2 == -1 or !accept(')')) {
+				return fail("expected ')'");
+			}
+			return binary(name == "min" ? GraphOp::min : GraphOp::max, arg1, arg2);
+		}
+		return fail("unknown function '" + name + "'");
+	}
+
+	int primary() {
+		skip_space();
+		float value;
+		if (accept('(')) {
+			int result = expr();
+			if (result != -1 and !accept(')')) {
+				return fail("expected ')'");
+			}
+			return result;
+		} else if (pos < line.size() and (std::isdigit(line[pos]) or line[pos] == '.')) {
+			if (!read_number(&value)) {
+				return fail("bad number");
+			}
+			GraphInstr instr;
+			instr.op = GraphOp::constant;
+			instr.constant = value;
+			return emit(instr);
+		}
+		string name = read_name();
+		if (name.empty()) {
+			return fail("expected a value");
+		}
+		if (accept('(')) {
+			return call(name);
+		}
+		return lookup(name);
+	}
+
+	int unary() {
+		if (accept('-')) {
+			int arg = unary();
+			if (arg != -1 and is_constant(arg)) {
+				// stays a constant, so it can be divided by or folded
+				GraphInstr instr;
+				instr.op = GraphOp::constant;
+				instr.constant = -constant(arg);
+				return emit(instr);
+			}
+			return arg == -1 ? -1 : with_constant(GraphOp::mulc, arg, -1);
+		}
+		return primary();
+	}
+
+	int term() {
+		int result = unary();
+		while (result != -1) {
+			if (accept('*')) {
+				int other = unary();
+				if (other == -1) {
+					return -1;
+				} else if (is_constant(other)) {
+					result = with_constant(GraphOp::mulc, result, constant(other));
+				} else if (is_constant(result)) {
+					result = with_constant(GraphOp::mulc, other, constant(result));
+				} else {
+					result = binary(GraphOp::mul, result, other);
+				}
+			} else if (accept('/')) {
+				int other = unary();
+				if (other == -1) {
+					return -1;
+				} else if (!is_constant(other)) {
+					return fail("can only divide by a number");
+				}
+				result = with_constant(GraphOp::mulc, result, 1 / constant(other));
+			} else {
+				break;
+			}
+		}
+		return result;
+	}
+
+	int expr() {
+		int result = term();
+		while (result != -1) {
+			if (accept('+')) {
+				int other = term();
+				if (other == -1) {
+					return -1;
+				} else if (is_constant(other)) {
+					result = with_constant(GraphOp::addc, result, constant(other));
+				} else if (is_constant(result)) {
+					result = with_constant(GraphOp::addc, other, constant(result));
+				} else {
+					result = binary(GraphOp::add, result, other);
+				}
+			} else if (accept('-')) {
+				int other = term();
+				if (other == -1) {
+					return -1;
+				} else if (is_constant(other)) {
+					result = with_constant(GraphOp::addc, result, -constant(other));
+				} else {
+					result = binary(GraphOp::sub, result, other);
+				}
+			} else {
+				break;
+			}
+		}
+		return result;
+	}
+};
+
+bool TerrainGraph::parse(istream& input, string filename) {
+	program.clear();
+	shapes.clear();
+	std::map<string,int> names;
+
+	string line;
+	int linenum = 0;
+	bool success = true;
+	while (std::getline(input, line)) {
+		linenum ++;
+		GraphParser parser {&program, &names, line};
+		if (parser.at_end()) {
+			continue;
+		}
+
+		string name = parser.read_name();
+		if (name == "shape") {
+			string blockname = parser.read_name();
+			auto block = block_names.find(blockname);
+			if (block == block_names.end()) {
+				parser.fail("unknown block '" + blockname + "'");
+			} else if (!parser.accept('=')) {
+				parser.fail("expected '='");
+			} else {
+				int reg = parser.expr();
+				if (reg != -1) {
+					shapes.push_back(GraphShape{reg, block->second});
+				}
+			}
+		} else if (name.empty()) {
+			parser.fail("expected a name");
+		} else if (parser.accept('+')) {
+			if (!parser.accept('=')) {
+				parser.fail("expected '+='");
+			} else {
+				int current = parser.lookup(name);
+				int reg = parser.expr();
+				if (reg != -1 and current != -1) {
+					names[name] = parser.binary(GraphOp::add, current, reg);
+				}
+			}
+		} else if (parser.accept('=')) {
+			int reg = parser.expr();
+			if (reg != -1) {
+				names[name] = reg;
+			}
+		} else {
+			parser.fail("expected '=' or '+='");
+		}
+
+		if (parser.error.empty() and !parser.at_end()) {
+			parser.fail("unexpected '" + line.substr(parser.pos) + "'");
+		}
+		if (!parser.error.empty()) {
+			std::cerr << "ERR: " << filename << ":" << linenum << ": " << parser.error << endl;
+			success = false;
+		}
+	}
+
+	if (success) {
+		remove_unused();
+	}
+	return success;
+}
+
+void TerrainGraph::remove_unused() {
+	vector<bool> used (program.size(), false);
+	for (GraphShape& shape : shapes) {
+		used[shape.reg] = true;
+	}
+	for (int i = program.size()-1; i >= 0; i --) {
+		if (used[i]) {
+			if (program[i].arg1 != -1) used[program[i].arg1] = true;
+			if (program[i].arg2 != -1) used[program[i].arg2] = true;
+		}
+	}
+
+	vector<int> newindex (program.size(), -1);
+	vector<GraphInstr> newprogram;
+	for (int i = 0; i < program.size(); i ++) {
+		if (used[i]) {
+			GraphInstr instr = program[i];
+			if (instr.arg1 != -1) instr.arg1 = newindex[instr.arg1];
+			if (instr.arg2 != -1) instr.arg2 = newindex[instr.arg2];
+			newindex[i] = newprogram.size();
+			newprogram.push_back(instr);
+		}
+	}
+	program.swap(newprogram);
+	for (GraphShape& shape : shapes) {
+		shape.reg = newindex[shape.reg];
+	}
+}
+
+
+// same as bound_mul in terrain.cc, zero times infinity is zero
+static inline float batch_bound_mul(float a, float b) {
+	return (a == 0 or b == 0) ? 0 : a * b;
+}
+
+void TerrainGraph::eval(TerrainContext* ctx, const vec3* positions, int count, ValueBatch* registers) const {
+	constexpr int size = ValueBatch::size;
+	float radius = ctx->radius;
+
+	// 2d noise only depends on x and z, so it is found for the first lane
+	// of each column and copied to the other lanes of the column
+	int column[size];
+	for (int i = 0; i < count; i ++) {
+		column[i] = i;
+		for (int j = 0; j < i; j ++) {
+			if (positions[j].x == positions[i].x and positions[j].z == positions[i].z) {
+				column[i] = j;
+				break;
+			}
+		}
+	}
+
+	// only the lanes below count are used, the others are never set
+	for (int reg = 0; reg < program.size(); reg ++) {
+		const GraphInstr& instr = program[reg];
+		ValueBatch& out = registers[reg];
+		const ValueBatch& a = registers[instr.arg1 == -1 ? reg : instr.arg1];
+		const ValueBatch& b = registers[instr.arg2 == -1 ? reg : instr.arg2];
+
+		switch (instr.op) {
+		case GraphOp::constant:
+			for (int i = 0; i < count; i ++) {
+				out.value[i] = out.lower[i] = out.upper[i] = instr.constant;
+				out.deriv[i] = 0;
+			}
+			break;
+		case GraphOp::posx:
+		case GraphOp::posy:
+		case GraphOp::posz: {
+			int axis = int(instr.op) - int(GraphOp::posx);
+			for (int i = 0; i < count; i ++) {
+				out.set(i, TerrainValue(positions[i][axis], 1, radius));
+			}
+			break;
+		}
+		case GraphOp::perlin2d:
+			for (int i = 0; i < count; i ++) {
+				out.set(i, column[i] != i ? out.get(column[i])
+					: perlin2d(ctx, positions[i], instr.scale, instr.height, instr.layer));
+			}
+			break;
+		case GraphOp::perlin3d:
+			for (int i = 0; i < count; i ++) {
+				out.set(i, perlin3d(ctx, positions[i], instr.scale, instr.height, instr.layer));
+			}
+			break;
+		case GraphOp::fbm2d:
+			for (int i = 0; i < count; i ++) {
+				out.set(i, column[i] != i ? out.get(column[i])
+					: fbm2d(ctx, positions[i], instr.scale, instr.height, instr.octaves, instr.layer));
+			}
+			break;
+		case GraphOp::fbm3d:
+			for (int i = 0; i < count; i ++) {
+				out.set(i, fbm3d(ctx, positions[i], instr.scale, instr.height, instr.octaves, instr.layer));
+			}
+			break;
+		case GraphOp::add:
+			for (int i = 0; i < count; i ++) {
+				out.value[i] = a.value[i] + b.value[i];
+				out.deriv[i] = a.deriv[i] + b.deriv[i];
+				out.lower[i] = a.lower[i] + b.lower[i];
+				out.upper[i] = a.upper[i] + b.upper[i];
+			}
+			break;
+		case GraphOp::sub:
+			for (int i = 0; i < count; i ++) {
+				float lower = a.lower[i] - b.upper[i];
+				float upper = a.upper[i] - b.lower[i];
+				out.value[i] = a.value[i] - b.value[i];
+				out.deriv[i] = a.deriv[i] + b.deriv[i];
+				out.lower[i] = lower;
+				out.upper[i] = upper;
+			}
+			break;
+		case GraphOp::mul:
+			for (int i = 0; i < count; i ++) {
+				out.set(i, a.get(i) * b.get(i));
+			}
+			break;
+		case GraphOp::min:
+			for (int i = 0; i < count; i ++) {
+				out.value[i] = std::min(a.value[i], b.value[i]);
+				out.deriv[i] = std::max(a.deriv[i], b.deriv[i]);
+				out.lower[i] = std::min(a.lower[i], b.lower[i]);
+				out.upper[i] = std::min(a.upper[i], b.upper[i]);
+			}
+			break;
+		case GraphOp::max:
+			for (int i = 0; i < count; i ++) {
+				out.value[i] = std::max(a.value[i], b.value[i]);
+				out.deriv[i] = std::max(a.deriv[i], b.deriv[i]);
+				out.lower[i] = std::max(a.lower[i], b.lower[i]);
+				out.upper[i] = std::max(a.upper[i], b.upper[i]);
+			}
+			break;
+		case GraphOp::abs:
+			for (int i = 0; i < count; i ++) {
+				float lower = a.lower[i], upper = a.upper[i];
+				out.value[i] = std::abs(a.value[i]);
+				out.deriv[i] = a.deriv[i];
+				out.lower[i] = lower >= 0 ? lower : upper <= 0 ? -upper : 0;
+				out.upper[i] = lower >= 0 ? upper : upper <= 0 ? -lower : std::max(-lower, upper);
+			}
+			break;
+		case GraphOp::addc:
+			for (int i = 0; i < count; i ++) {
+				out.value[i] = a.value[i] + instr.constant;
+				out.deriv[i] = a.deriv[i];
+				out.lower[i] = a.lower[i] + instr.constant;
+				out.upper[i] = a.upper[i] + instr.constant;
+			}
+			break;
+		case GraphOp::mulc: {
+			float val = instr.constant;
+			if (val >= 0) {
+				for (int i = 0; i < count; i ++) {
+					out.value[i] = a.value[i] * val;
+					out.deriv[i] = a.deriv[i] * val;
+					out.lower[i] = batch_bound_mul(a.lower[i], val);
+					out.upper[i] = batch_bound_mul(a.upper[i], val);
+				}
+			} else {
+				for (int i = 0; i < count; i ++) {
+					float lower = batch_bound_mul(a.upper[i], val);
+					float upper = batch_bound_mul(a.lower[i], val);
+					out.value[i] = a.value[i] * val;
+					out.deriv[i] = a.deriv[i] * -val;
+					out.lower[i] = lower;
+					out.upper[i] = upper;
+				}
+			}
+			break;
+		}
+		}
+	}
+}
+
+int TerrainGraph::find_shape(const ValueBatch* registers, int lane, int scale) const {
+	for (int i = 0; i < shapes.size(); i ++) {
+		TerrainValue value = registers[shapes[i].reg].get(lane);
+		if (value.needs_split(scale)) {
+			return -1;
+		} else if (value.value < 0) {
+			return i;
+		}
+	}
+	return shapes.size();
+}
+
+int TerrainGraph::center_shape(const ValueBatch* registers, int lane) const {
+	for (int i = 0; i < shapes.size(); i ++) {
+		if (registers[shapes[i].reg].get(lane).value < 0) {
+			return i;
+		}
+	}
+	return shapes.size();
+}
+
+
+
+GraphGenerator::GraphGenerator(int seed): TerrainGenerator(seed) {
+	string path = pluginloader()->find_path(terrain_graph);
+	std::ifstream ifile (path);
+	if (!ifile.good()) {
+		std::cerr << "ERR: GraphGenerator: cannot open terrain graph '" << path << "'" << endl;
+		exit(1);
+	}
+	std::stringstream contents;
+	contents << ifile.rdbuf();
+	source = contents.str();
+
+	std::istringstream input (source);
+	if (!graph.parse(input, path)) {
+		exit(1);
+	}
+}
+
+int GraphGenerator::version() {
+	return 1;
+}
+
+uint64 GraphGenerator::fingerprint() {
+	// the terrain changes whenever the file does
+	uint64 hash = TerrainGenerator::fingerprint();
+	for (char c : source) {
+		hash = (hash ^ uint8(c)) * 1099511628211ull;
+	}
+	return hash;
+}
+
+ValueBatch* GraphGenerator::Scratch::registers(int depth, int size) {
+	if (depth >= levels.size()) {
+		levels.resize(depth+1);
+	}
+	levels[depth].resize(size);
+	return levels[depth].data();
+}
+
+TerrainContext GraphGenerator::make_context(int scale) {
+	TerrainContext context;
+	context.seed = seed;
+	context.falloff = default_falloff;
+	context.radius = (interval_bounds and scale > 1) ? scale / 2.0f : 0;
+	context.scale = scale;
+	return context;
+}
+
+void GraphGenerator::generate_chunk(NodeView node, int depth) {
+	ASSERT(!node.haschildren());
+	Scratch scratch;
+	GenerationStats genstats;
+	gen_root(node, depth_scale(node.scale, depth), &scratch, &genstats);
+	add_stats(genstats);
+}
+
+void GraphGenerator::generate_stream(ivec3 position, int scale, int depth, string* out) {
+	Scratch scratch;
+	GenerationStats genstats;
+	gen_root(StreamNode {position, scale, out}, depth_scale(scale, depth), &scratch, &genstats);
+	add_stats(genstats);
+}
+
+void GraphGenerator::gen_height_tile(HeightTile* tile) {
+	std::fill(tile->heights, tile->heights + HeightTile::size*HeightTile::size, height_min);
+	Scratch scratch;
+	GenerationStats genstats;
+
+	for (int y = height_max - HeightTile::size; y >= height_min; y -= HeightTile::size) {
+		HeightNode node {ivec3(tile->position.x, y, tile->position.y), HeightTile::size, tile};
+		if (node.skip()) {
+			break;
+		}
+		gen_root(node, 1, &scratch, &genstats);
+	}
+}
+
+template <typename NodeT>
+BlockData* GraphGenerator::gen_root(NodeT node, int min_scale, Scratch* scratch, GenerationStats* genstats) {
+	if (skip_node(node)) {
+		return BLOCK_NULL;
+	}
+	ValueBatch* registers = scratch->registers(0, graph.program.size());
+	TerrainContext context = make_context(node.scale);
+	vec3 pos = vec3(node.position) + float(node.scale)/2;
+	graph.eval(&context, &pos, 1, registers);
+	return gen_node(node, registers, 0, 0, min_scale, scratch, genstats);
+}
+
+template <typename NodeT>
+BlockData* GraphGenerator::gen_node(NodeT node, const ValueBatch* registers, int lane, int depth, int min_scale,
+		Scratch* scratch, GenerationStats* genstats) {
+	if (skip_node(node)) {
+		return BLOCK_NULL;
+	}
+	int shape = graph.find_shape(registers, lane, node.scale);
+	bool unfinished = shape == -1 and node.scale <= min_scale;
+	if (unfinished) {
+		shape = graph.center_shape(registers, lane);
+	} else if (shape == -1) {
+		return split_node(node, depth, min_scale, scratch, genstats);
+	}
+	BlockData* type = shape < graph.shapes.size() ? graph.shapes[shape].type : nullptr;
+	set_leaf(node, type);
+	genstats->leaves ++;
+	if (unfinished) {
+		// kept from being joined, like in BiomeGraphGenerator::gen_shapes
+		set_unfinished(node);
+		return BLOCK_SPLIT;
+	}
+	return type;
+}
+
+template <typename NodeT>
+BlockData* GraphGenerator::split_node(NodeT node, int depth, int min_scale, Scratch* scratch, GenerationStats* genstats) {
+	node.split();
+	genstats->splits ++;
+
+	// all the children that are not skipped are found in one batch
+	vec3 positions[BDIMS3];
+	int lanes[BDIMS3];
+	int count = 0;
+	for (int i = 0; i < BDIMS3; i ++) {
+		NodeT child = node.child(i);
+		if (skip_node(child)) {
+			lanes[i] = -1;
+		} else {
+			positions[count] = vec3(child.position) + float(child.scale)/2;
+			lanes[i] = count ++;
+		}
+	}
+
+	ValueBatch* registers = scratch->registers(depth+1, graph.program.size());
+	if (count > 0) {
+		TerrainContext context = make_context(node.scale / BDIMS);
+		graph.eval(&context, positions, count, registers);
+	}
+
+	BlockData* blocktype = nullptr;
+	for (int i = 0; i < BDIMS3; i ++) {
+		BlockData* newtype = lanes[i] == -1 ? BLOCK_NULL
+			: gen_node(node.child(i), registers, lanes[i], depth+1, min_scale, scratch, genstats);
+		blocktype = (i == 0 or newtype == blocktype) ? newtype : BLOCK_SPLIT;
+	}
+
+	if (blocktype != BLOCK_SPLIT) {
+		node.join();
+		set_leaf(node, blocktype);
+		genstats->joins ++;
+		genstats->leaves -= BDIMS3 - 1;
+	}
+
+	return blocktype;
+}
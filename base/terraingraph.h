@@ -0,0 +1,124 @@
+#ifndef BASE_TERRAINGRAPH
+#define BASE_TERRAINGRAPH
+
+#include "common.h"
+#include "plugins.h"
+#include "terrain.h"
+
+// Terrain described by a text file instead of c++, so it can be changed
+// without recompiling. Each line adds to a layer, names a value or adds
+// a shape, like:
+//
+// ground_level += fbm2d(64, 64, 3, 1) + y
+// shape stone = ground_level
+//
+// The file is compiled to a list of instructions, which is run over a batch
+// of positions at once (all the children of a node), so the cost of
+// interpreting each instruction is shared by the whole batch. The arithmetic
+// is done a field at a time over the batch, and 2d noise is only found once
+// for each column of the batch. 3d noise is still found for each position,
+// so graphs with a lot of it gain little from the batches.
+
+enum class GraphOp : uint8 {
+	constant, posx, posy, posz,
+	perlin2d, perlin3d, fbm2d, fbm3d,
+	add, sub, mul, min, max, abs,
+	// with a constant instead of a second register
+	addc, mulc,
+};
+
+struct GraphInstr {
+	GraphOp op;
+	// registers that are read, the result is put in
+	// the register with the index of the instruction
+	int arg1 = -1;
+	int arg2 = -1;
+	float constant = 0;
+	// settings of the noise ops
+	int scale = 0;
+	int height = 0;
+	int octaves = 0;
+	int layer = 0;
+};
+
+// TerrainValues of a whole batch, stored as one array per
+// field so each op is a simple loop over the lanes. Only
+// the lanes that are in use are set
+struct ValueBatch {
+	static constexpr int size = BDIMS3;
+	float value[size];
+	float deriv[size];
+	float lower[size];
+	float upper[size];
+
+	TerrainValue get(int lane) const;
+	void set(int lane, const TerrainValue& val);
+};
+
+struct GraphShape {
+	int reg;
+	BlockData* type;
+};
+
+class TerrainGraph {
+public:
+	vector<GraphInstr> program;
+	// checked in order, the first one below zero fills the node
+	vector<GraphShape> shapes;
+
+	// compiles the file, printing any errors and returning false
+	bool parse(istream& input, string filename);
+
+	// runs the program for up to ValueBatch::size positions, which all
+	// have to be the centers of nodes of the same size as ctx->scale
+	void eval(TerrainContext* ctx, const vec3* positions, int count, ValueBatch* registers) const;
+
+	// index of the shape that fills the lane, shapes.size() for air,
+	// or -1 if the surface of a shape could be inside the node
+	int find_shape(const ValueBatch* registers, int lane, int scale) const;
+	// index of the shape that the center of the lane is in, for
+	// nodes that are too small to split at the depth being generated
+	int center_shape(const ValueBatch* registers, int lane) const;
+
+private:
+	// removes instructions that no shape depends on
+	void remove_unused();
+};
+
+
+// generates the terrain of the file in the terrain_graph param
+class GraphGenerator : public TerrainGenerator {
+	PLUGIN(GraphGenerator);
+public:
+	GraphGenerator(int seed);
+
+	virtual void generate_chunk(NodeView node, int depth);
+	virtual void gen_height_tile(HeightTile* tile);
+	virtual void generate_stream(ivec3 position, int scale, int depth, string* out);
+	virtual int version();
+	virtual uint64 fingerprint();
+
+protected:
+	TerrainGraph graph;
+	string source;
+
+	// registers of each level of the octree, so the batch of a
+	// node is kept while its children are generated
+	struct Scratch {
+		vector<vector<ValueBatch>> levels;
+		ValueBatch* registers(int depth, int size);
+	};
+
+	TerrainContext make_context(int scale);
+
+	// nodes of min_scale are not split, see TerrainGenerator::generate_chunk
+	template <typename NodeT>
+	BlockData* gen_root(NodeT node, int min_scale, Scratch* scratch, GenerationStats* genstats);
+	template <typename NodeT>
+	BlockData* gen_node(NodeT node, const ValueBatch* registers, int lane, int depth, int min_scale,
+		Scratch* scratch, GenerationStats* genstats);
+	template <typename NodeT>
+	BlockData* split_node(NodeT node, int depth, int min_scale, Scratch* scratch, GenerationStats* genstats);
+};
+
+#endif
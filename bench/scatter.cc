@@ -0,0 +1,159 @@
+#include "base/common.h"
+#include "base/plugins.h"
+#include "base/terrain.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+/*
+Benchmark of ScatterSampler, compared with placing points by rejection
+sampling separately in each region. Finds the points of a square of regions,
+and checks that they are spaced out, including across the borders of the
+regions. Prints the results as json, like:
+
+./bench_scatter bench_spacing=8 bench_region=64 bench_regions=32
+*/
+
+int PARAM(bench_seed) = 12345;
+int PARAM(bench_spacing) = 8;
+// size of each region, like the size of a chunk
+int PARAM(bench_region) = 64;
+// number of regions along each side of the square
+int PARAM(bench_regions) = 32;
+int PARAM(bench_candidates) = 2;
+int PARAM(bench_rounds) = 3;
+
+
+struct ScatterResult {
+	string name;
+	double time = 0;
+	int64 points = 0;
+	// pairs of points closer than the spacing
+	int64 close_pairs = 0;
+};
+
+int64 count_close_pairs(const vector<ivec2>& points, int spacing) {
+	std::unordered_map<int64,vector<ivec2>> buckets;
+	auto key = [] (ivec2 cell) {
+		return (int64(cell.x) << 32) ^ uint(cell.y);
+	};
+	for (ivec2 point : points) {
+		buckets[key(safefloor(vec2(point) / float(spacing)))].push_back(point);
+	}
+
+	int64 count = 0;
+	for (ivec2 point : points) {
+		ivec2 cell = safefloor(vec2(point) / float(spacing));
+		for (int x = -1; x <= 1; x ++) {
+			for (int y = -1; y <= 1; y ++) {
+				auto iter = buckets.find(key(cell + ivec2(x,y)));
+				if (iter == buckets.end()) continue;
+				for (ivec2 other : iter->second) {
+					ivec2 dist = other - point;
+					if (dist != ivec2(0,0) and dist.x*dist.x + dist.y*dist.y < spacing*spacing) {
+						count ++;
+					}
+				}
+			}
+		}
+	}
+	// each pair was counted from both sides
+	return count / 2;
+}
+
+// each region throws darts at itself, keeping the ones that are far enough
+// from the points it kept before. Regions do not know about each other
+void rejection_points(ivec2 low, int size, vector<ivec2>* out) {
+	int start = out->size();
+	int darts = size * size / (bench_spacing * bench_spacing) * bench_candidates;
+	for (int i = 0; i < darts; i ++) {
+		ivec2 point = low + ivec2(
+			uint(hash4(bench_seed, low, i, 0)) % size,
+			uint(hash4(bench_seed, low, i, 1)) % size
+		);
+		bool kept = true;
+		for (int j = start; j < out->size() and kept; j ++) {
+			ivec2 dist = (*out)[j] - point;
+			kept = dist.x*dist.x + dist.y*dist.y >= bench_spacing*bench_spacing;
+		}
+		if (kept) {
+			out->push_back(point);
+		}
+	}
+}
+
+template <typename Func>
+ScatterResult run_regions(string name, Func func) {
+	ScatterResult result;
+	result.name = name;
+	vector<ivec2> points;
+	double start = getTime();
+	for (int x = 0; x < bench_regions; x ++) {
+		for (int y = 0; y < bench_regions; y ++) {
+			func(ivec2(x,y) * bench_region, bench_region, &points);
+		}
+	}
+	result.time = getTime() - start;
+	result.points = points.size();
+	result.close_pairs = count_close_pairs(points, bench_spacing);
+	return result;
+}
+
+void print_result(const ScatterResult& result) {
+	cout << "    {" << endl;
+	cout << "      \"name\": \"" << result.name << "\"," << endl;
+	cout << "      \"time\": " << result.time << "," << endl;
+	cout << "      \"points\": " << result.points << "," << endl;
+	cout << "      \"points_per_sec\": " << int64(result.points / result.time) << "," << endl;
+	cout << "      \"points_per_cell\": " << double(result.points) * bench_spacing * bench_spacing
+		/ (double(bench_region) * bench_region * bench_regions * bench_regions) << "," << endl;
+	cout << "      \"close_pairs\": " << result.close_pairs << endl;
+	cout << "    }";
+}
+
+int main(int numargs, char** args) {
+	// the plugin loader prints to cout, which would break the json
+	std::streambuf* coutbuf = cout.rdbuf(std::cerr.rdbuf());
+	pluginloader()->load(numargs-1, args+1);
+	cout.rdbuf(coutbuf);
+
+	ScatterSampler sampler (bench_seed, bench_spacing, 0, bench_candidates, bench_rounds);
+
+	vector<ScatterResult> results;
+	results.push_back(run_regions("scatter", [&] (ivec2 low, int size, vector<ivec2>* out) {
+		sampler.points(low, low + size, out);
+	}));
+	results.push_back(run_regions("rejection", rejection_points));
+
+	// the regions found separately should be the same
+	// as the whole square found at once
+	vector<ivec2> tiled;
+	for (int x = 0; x < bench_regions; x ++) {
+		for (int y = 0; y < bench_regions; y ++) {
+			ivec2 low = ivec2(x,y) * bench_region;
+			sampler.points(low, low + bench_region, &tiled);
+		}
+	}
+	vector<ivec2> whole;
+	sampler.points(ivec2(0,0), ivec2(bench_region * bench_regions), &whole);
+	auto less = [] (ivec2 a, ivec2 b) {
+		return std::tie(a.x, a.y) < std::tie(b.x, b.y);
+	};
+	std::sort(tiled.begin(), tiled.end(), less);
+	std::sort(whole.begin(), whole.end(), less);
+
+	cout << "{" << endl;
+	cout << "  \"spacing\": " << bench_spacing << "," << endl;
+	cout << "  \"region\": " << bench_region << "," << endl;
+	cout << "  \"regions\": " << bench_regions * bench_regions << "," << endl;
+	cout << "  \"candidates\": " << bench_candidates << "," << endl;
+	cout << "  \"rounds\": " << bench_rounds << "," << endl;
+	cout << "  \"regions_match_whole\": " << (tiled == whole ? "true" : "false") << "," << endl;
+	cout << "  \"runs\": [" << endl;
+	for (int i = 0; i < results.size(); i ++) {
+		print_result(results[i]);
+		cout << (i+1 < results.size() ? "," : "") << endl;
+	}
+	cout << "  ]" << endl;
+	cout << "}" << endl;
+}
@@ -0,0 +1,333 @@
+#include "base/common.h"
+#include "base/plugins.h"
+#include "base/blocks.h"
+#include "base/terrain.h"
+#include "base/blockiter.h"
+#include "base/fileformat.h"
+#include "threadpool/pool.h"
+
+#include <sstream>
+#include <atomic>
+#include <condition_variable>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/*
+Benchmark of the terrain generator, without any graphics. Generates a cube
+of chunks for every seed and depth, and prints the results as json, like:
+
+./bench_terrain bench_seeds=3 bench_depths=4,8 bench_size=2 bench_scale=256
+
+Chunks are generated down to nodes of bench_scale >> depth, so a depth of
+log2(bench_scale) is full detail. peak_memory_kb is the peak of the whole
+process over all the runs, not of each run.
+
+With bench_decorate=1 the chunks of full detail runs are also decorated, as
+parallel jobs on bench_threads threads. With bench_stream=1 the chunks are written straight
+to the stream of the file format instead of being made as octrees, and
+are not decorated.
+
+With bench_refine=d the chunks are first generated to depth d, then
+generated again to the depth of the run in the same nodes, both through a
+GenerationCache in bench_cache_dir, like when SingleTreeGame adds detail.
+refine_matches is whether they are the same as chunks generated to that
+depth directly, including the nodes flagged as unfinished. The second time
+the same runs are done, both depths are read from the cache.
+
+hops counts the nodes that moved to another biome and kept the layers they
+had, and hop_samples the ones of those that still sampled the lerp of the
+biome they left, because they were split. BiomeGenerator has no hops, run
+with TerrainGenerator=ClimateBiomeGenerator to see them.
+
+Plugins and parameters can be passed in the same way as for scrolls.
+*/
+
+int PARAM(bench_seed) = 12345;
+int PARAM(bench_seeds) = 1;
+string PARAM(bench_depths) = string("8");
+// number of chunks along each side of the cube that is generated
+int PARAM(bench_size) = 2;
+int PARAM(bench_scale) = 256;
+bool PARAM(bench_decorate) = false;
+int PARAM(bench_threads) = 4;
+bool PARAM(bench_stream) = false;
+int PARAM(bench_refine) = -1;
+string PARAM(bench_cache_dir) = string("world/gencache/");
+
+
+struct DepthCount {
+	int64 nodes = 0;
+	int64 leaves = 0;
+};
+
+struct BenchResult {
+	int seed;
+	int depth;
+	double time = 0;
+	int64 nodes = 0;
+	int64 leaves = 0;
+	GenerationStats stats;
+	bool refined = false;
+	bool refine_matches = false;
+	bool decorated = false;
+	double decorate_time = 0;
+	DecorationStats decstats;
+	vector<DepthCount> histogram;
+};
+
+
+void count_nodes(NodeView node, int depth, BenchResult* result) {
+	if (depth >= int(result->histogram.size())) {
+		result->histogram.resize(depth+1);
+	}
+	result->nodes ++;
+	result->histogram[depth].nodes ++;
+	if (node.haschildren()) {
+		for (int i = 0; i < BDIMS3; i ++) {
+			count_nodes(node.child(i), depth+1, result);
+		}
+	} else {
+		result->leaves ++;
+		result->histogram[depth].leaves ++;
+	}
+}
+
+// the same blocks, and the same leaves flagged as unfinished
+bool same_chunk(NodeView chunk, NodeView other) {
+	std::ostringstream data, otherdata;
+	SequentialFileFormat().to_file(chunk, data);
+	SequentialFileFormat().to_file(other, otherdata);
+	if (data.str() != otherdata.str()) {
+		return false;
+	}
+	vector<bool> flags;
+	for (NodeView leaf : chunk.iter<BlockIter>()) {
+		flags.push_back(leaf.test_flag(Block::GENERATION_FLAG));
+	}
+	int i = 0;
+	for (NodeView leaf : other.iter<BlockIter>()) {
+		if (flags[i++] != bool(leaf.test_flag(Block::GENERATION_FLAG))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+// same as count_nodes, but reading the pre-order stream
+void count_stream(const string& data, int* pos, int depth, BenchResult* result) {
+	if (depth >= int(result->histogram.size())) {
+		result->histogram.resize(depth+1);
+	}
+	result->nodes ++;
+	result->histogram[depth].nodes ++;
+	if (data[(*pos)++] == '{') {
+		for (int i = 0; i < BDIMS3; i ++) {
+			count_stream(data, pos, depth+1, result);
+		}
+	} else {
+		result->leaves ++;
+		result->histogram[depth].leaves ++;
+	}
+}
+
+BenchResult run_stream_bench(int seed, int depth) {
+	BenchResult result;
+	result.seed = seed;
+	result.depth = depth;
+	
+	TerrainGenerator* generator = TerrainGenerator::plugnew(seed);
+	ivec3 start = ivec3(-bench_size/2);
+	string data;
+	for (int x = 0; x < bench_size; x ++) {
+		for (int y = 0; y < bench_size; y ++) {
+			for (int z = 0; z < bench_size; z ++) {
+				data.clear();
+				double starttime = getTime();
+				generator->generate_stream((start + ivec3(x,y,z)) * bench_scale, bench_scale, depth, &data);
+				result.time += getTime() - starttime;
+				int pos = 0;
+				count_stream(data, &pos, 0, &result);
+			}
+		}
+	}
+	
+	result.stats = generator->get_stats();
+	plugdelete(generator);
+	return result;
+}
+
+BenchResult run_bench(int seed, int depth) {
+	if (bench_stream) {
+		return run_stream_bench(seed, depth);
+	}
+	
+	BenchResult result;
+	result.seed = seed;
+	result.depth = depth;
+
+	TerrainGenerator* generator = TerrainGenerator::plugnew(seed);
+	vector<BlockContainer> chunks;
+	// the decoration jobs keep pointers to the chunks
+	chunks.reserve(bench_size * bench_size * bench_size);
+
+	ivec3 start = ivec3(-bench_size/2);
+	for (int x = 0; x < bench_size; x ++) {
+		for (int y = 0; y < bench_size; y ++) {
+			for (int z = 0; z < bench_size; z ++) {
+				chunks.emplace_back((start + ivec3(x,y,z)) * bench_scale, bench_scale);
+			}
+		}
+	}
+
+	GenerationCache* cache = nullptr;
+	if (bench_refine >= 0) {
+		cache = new GenerationCache(bench_cache_dir, generator);
+		for (BlockContainer& chunk : chunks) {
+			cache->generate_chunk(chunk, bench_refine);
+		}
+	}
+
+	double starttime = getTime();
+	for (BlockContainer& chunk : chunks) {
+		if (cache != nullptr) {
+			cache->generate_chunk(chunk, depth);
+		} else {
+			generator->generate_chunk(chunk, depth);
+		}
+	}
+	result.time = getTime() - starttime;
+
+	if (cache != nullptr) {
+		// a generator of its own, so the stats are only of the run
+		TerrainGenerator* direct = TerrainGenerator::plugnew(seed);
+		result.refined = true;
+		result.refine_matches = true;
+		for (BlockContainer& chunk : chunks) {
+			BlockContainer directchunk (chunk.position, chunk.scale);
+			direct->generate_chunk(directchunk, depth);
+			result.refine_matches = result.refine_matches and same_chunk(chunk, directchunk);
+		}
+		plugdelete(direct);
+		delete cache;
+	}
+
+	// structures are made of single blocks, so they are only placed at full detail
+	result.decorated = bench_decorate and depth >= TerrainGenerator::full_depth(bench_scale);
+	if (result.decorated) {
+		TerrainDecorator* decorator = TerrainDecorator::plugnew(generator);
+		std::mutex lock;
+		std::condition_variable done;
+		int remaining = chunks.size();
+
+		starttime = getTime();
+		{
+			Pool pool (bench_threads);
+			for (BlockContainer& chunk : chunks) {
+				pool.pushJob([&, chunk = &chunk] () {
+					decorator->decorate_chunk(*chunk);
+					std::lock_guard guard(lock);
+					remaining --;
+					done.notify_all();
+				});
+			}
+			std::unique_lock guard(lock);
+			done.wait(guard, [&] () { return remaining == 0; });
+		}
+		result.decorate_time = getTime() - starttime;
+		result.decstats = decorator->get_stats();
+		plugdelete(decorator);
+	}
+
+	for (BlockContainer& chunk : chunks) {
+		count_nodes(chunk, 0, &result);
+	}
+	chunks.clear();
+
+	result.stats = generator->get_stats();
+	plugdelete(generator);
+	return result;
+}
+
+// of the whole process so far, in kilobytes
+int64 peak_memory() {
+#ifndef _WIN32
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return 0;
+#endif
+}
+
+void print_result(const BenchResult& result) {
+	cout << "    {" << endl;
+	cout << "      \"seed\": " << result.seed << "," << endl;
+	cout << "      \"depth\": " << result.depth << "," << endl;
+	cout << "      \"time\": " << result.time << "," << endl;
+	cout << "      \"nodes\": " << result.nodes << "," << endl;
+	cout << "      \"nodes_per_sec\": " << int64(result.nodes / result.time) << "," << endl;
+	cout << "      \"leaves\": " << result.leaves << "," << endl;
+	cout << "      \"splits\": " << result.stats.splits << "," << endl;
+	cout << "      \"joins\": " << result.stats.joins << "," << endl;
+	cout << "      \"hops\": " << result.stats.hops << "," << endl;
+	cout << "      \"hop_samples\": " << result.stats.hop_samples << "," << endl;
+	if (result.refined) {
+		cout << "      \"refined_from\": " << bench_refine << "," << endl;
+		cout << "      \"refine_matches\": " << (result.refine_matches ? "true" : "false") << "," << endl;
+	}
+	if (result.decorated) {
+		cout << "      \"decoration\": {" << endl;
+		cout << "        \"time\": " << result.decorate_time << "," << endl;
+		cout << "        \"chunks_per_sec\": " << result.decstats.chunks / result.decorate_time << "," << endl;
+		cout << "        \"time_per_chunk\": " << result.decstats.time / result.decstats.chunks << "," << endl;
+		cout << "        \"structures\": " << result.decstats.structures << "," << endl;
+		cout << "        \"writes\": " << result.decstats.writes << "," << endl;
+		cout << "        \"shared\": " << result.decstats.shared << endl;
+		cout << "      }," << endl;
+	}
+	cout << "      \"histogram\": [" << endl;
+	for (int i = 0; i < int(result.histogram.size()); i ++) {
+		cout << "        {\"depth\": " << i << ", \"nodes\": " << result.histogram[i].nodes
+			<< ", \"leaves\": " << result.histogram[i].leaves << "}";
+		cout << (i+1 < int(result.histogram.size()) ? "," : "") << endl;
+	}
+	cout << "      ]" << endl;
+	cout << "    }";
+}
+
+int main(int numargs, char** args) {
+	// the plugin loader prints to cout, which would break the json
+	std::streambuf* coutbuf = cout.rdbuf(std::cerr.rdbuf());
+	pluginloader()->load(numargs-1, args+1);
+	cout.rdbuf(coutbuf);
+
+	vector<int> depths;
+	std::istringstream depthstream (bench_depths);
+	string depthstr;
+	while (std::getline(depthstream, depthstr, ',')) {
+		depths.push_back(std::stoi(depthstr));
+	}
+
+	vector<BenchResult> results;
+	for (int i = 0; i < bench_seeds; i ++) {
+		for (int depth : depths) {
+			results.push_back(run_bench(bench_seed + i, depth));
+		}
+	}
+
+	cout << "{" << endl;
+	cout << "  \"generator\": \"" << TerrainGenerator::selected_plugin->id << "\"," << endl;
+	cout << "  \"chunk_scale\": " << bench_scale << "," << endl;
+	cout << "  \"stream\": " << (bench_stream ? "true" : "false") << "," << endl;
+	cout << "  \"chunks_per_run\": " << bench_size * bench_size * bench_size << "," << endl;
+	cout << "  \"process_peak_memory_kb\": " << peak_memory() << "," << endl;
+	cout << "  \"runs\": [" << endl;
+	for (int i = 0; i < int(results.size()); i ++) {
+		print_result(results[i]);
+		cout << (i+1 < int(results.size()) ? "," : "") << endl;
+	}
+	cout << "  ]" << endl;
+	cout << "}" << endl;
+}
@@ -0,0 +1,11 @@
+#include "debug.h"
+
+EXPORT_PLUGIN(NullDebugLines);
+
+void NullDebugLines::draw(vec2 start, vec2 end) {
+	
+}
+
+void NullDebugLines::clear() {
+	
+}
@@ -0,0 +1,14 @@
+#ifndef HEADLESS_DEBUG
+#define HEADLESS_DEBUG
+
+#include "base/common.h"
+#include "base/debug.h"
+
+class NullDebugLines : public DebugLines {
+	PLUGIN(NullDebugLines);
+public:
+	virtual void draw(vec2 start, vec2 end);
+	virtual void clear();
+};
+
+#endif
@@ -0,0 +1,91 @@
+#include "game.h"
+#include "graphics.h"
+
+#include <thread>
+#include <chrono>
+
+EXPORT_PLUGIN(HeadlessGame);
+
+// ticks per second, used instead of sim_tick_rate
+int PARAM(headless_tick_rate) = 20;
+// seconds of game time to run for, or 0 to run until stopped.
+// A replay runs until it ends instead
+float PARAM(headless_seconds) = 60;
+// false runs the ticks as fast as possible instead of waiting for each one
+bool PARAM(headless_realtime) = true;
+// speed of the spectator in blocks per second
+float PARAM(headless_speed) = 16;
+// the spectator turns a quarter after walking for this long, so it goes
+// around a square and comes back to chunks it loaded before
+float PARAM(headless_leg_seconds) = 15;
+
+HeadlessGame::HeadlessGame() {
+	tick_rate = headless_tick_rate;
+	realtime = headless_realtime;
+}
+
+void HeadlessGame::move_spectator(double deltatime) {
+	int leg = sim_time / headless_leg_seconds;
+	spectator.angle = vec2(leg * 3.14159f / 2, 0);
+	spectator.velocity = spectator.view_direction() * headless_speed;
+	spectator.position += spectator.velocity * float(deltatime);
+}
+
+void HeadlessGame::simulate(double deltatime) {
+	// there are no frames, so the replay measures the ticks instead
+	double curtime = getTime();
+	if (replaying) {
+		std::lock_guard guard(sim_lock);
+		frame_times.push_back(ticks > 0 ? curtime - last_time : deltatime);
+	}
+	last_time = curtime;
+	
+	if (!replaying) {
+		move_spectator(deltatime);
+	}
+	// this stops the game at the end of a replay
+	update_path(deltatime);
+	update_stream_goal();
+	
+	if ((ticks + 1) % tick_rate == 0) {
+		print_status();
+	}
+	if (!replaying and headless_seconds > 0 and sim_time + deltatime >= headless_seconds) {
+		sim_done = true;
+	}
+}
+
+void HeadlessGame::timestep() {
+	// everything happens on simthread
+	std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	playing = !sim_done;
+}
+
+void HeadlessGame::print_status() {
+	int loaded, queued;
+	{
+		std::lock_guard guard(isChunkLoading_lock);
+		loaded = generatedWorld.size();
+		queued = load_queue.size();
+	}
+	int64 entered, missed;
+	{
+		std::lock_guard guard(stream_lock);
+		entered = chunks_entered;
+		missed = chunks_missed;
+	}
+	int64 late;
+	{
+		std::lock_guard guard(sim_lock);
+		late = late_ticks;
+	}
+	ChunkCacheStats cachestats = chunkcache->get_stats();
+	NullRenderBuf* renderbuf = dynamic_cast<NullRenderBuf*>(graphics->blockbuf);
+	
+	cout << "time " << sim_time + 1.0 / tick_rate << " pos " << ivec3(spectator.position)
+		<< " loaded " << loaded << " queued " << queued
+		<< " missed " << missed << "/" << entered
+		<< " cache " << cachestats.hits << "/" << cachestats.packed_hits << "/" << cachestats.misses
+		<< " faces " << (renderbuf != nullptr ? int64(renderbuf->faces) : -1)
+		<< " late " << late << endl;
+}
@@ -0,0 +1,27 @@
+#ifndef HEADLESS_GAME
+#define HEADLESS_GAME
+
+#include "base/common.h"
+#include "base/game.h"
+
+// Runs SingleGame without a window, so streaming, generation and saving
+// can be tested on servers. The ticks of the simulation are run as usual,
+// but the spectator walks around a square instead of being controlled,
+// or follows replay_path
+class HeadlessGame : public SingleGame {
+	PLUGIN(HeadlessGame);
+public:
+	HeadlessGame();
+	
+	virtual void timestep();
+	
+protected:
+	// when the last tick started, for the frame times of replays
+	double last_time = 0;
+	
+	virtual void simulate(double deltatime);
+	void move_spectator(double deltatime);
+	void print_status();
+};
+
+#endif
@@ -0,0 +1,26 @@
+#include "graphics.h"
+
+EXPORT_PLUGIN(NullRenderBuf);
+
+void NullRenderBuf::add(RenderFace arr[], int size, RenderIndex* outindex) {
+	outindex->buf = this;
+	outindex->size = size;
+	faces += size;
+}
+
+void NullRenderBuf::del(RenderIndex* index) {
+	faces -= index->size;
+	index->size = 0;
+}
+
+void NullRenderBuf::sync() {
+	
+}
+
+
+
+EXPORT_PLUGIN(NullGraphics);
+
+void NullGraphics::swap() {
+	
+}
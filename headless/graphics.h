@@ -0,0 +1,28 @@
+#ifndef HEADLESS_GRAPHICS
+#define HEADLESS_GRAPHICS
+
+#include "base/common.h"
+#include "base/graphics.h"
+
+#include <atomic>
+
+// counts the faces instead of sending them to a gpu
+class NullRenderBuf : public RenderBuf {
+	PLUGIN(NullRenderBuf);
+public:
+	// faces that are rendered now
+	std::atomic<int64> faces = 0;
+	
+	virtual void add(RenderFace arr[], int size, RenderIndex* outindex);
+	virtual void del(RenderIndex* index);
+	virtual void sync();
+};
+
+// graphics context without a window, for running on machines without a gpu
+class NullGraphics : public GraphicsContext {
+	PLUGIN(NullGraphics);
+public:
+	virtual void swap();
+};
+
+#endif
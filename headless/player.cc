@@ -0,0 +1,30 @@
+#include "player.h"
+
+EXPORT_PLUGIN(NullControls);
+
+NullControls::NullControls() {
+	KEY_SHIFT = 1;
+	KEY_CTRL = 2;
+	KEY_ALT = 3;
+	KEY_TAB = 4;
+}
+
+bool NullControls::key_pressed(int keycode) {
+	return false;
+}
+
+bool NullControls::mouse_button(int button) {
+	return false;
+}
+
+ivec2 NullControls::mouse_pos() {
+	return mousepos;
+}
+
+void NullControls::mouse_pos(ivec2 newpos) {
+	mousepos = newpos;
+}
+
+int NullControls::scroll_rel() {
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef HEADLESS_PLAYER
+#define HEADLESS_PLAYER
+
+#include "base/common.h"
+#include "base/player.h"
+
+// controls where nothing is ever pressed
+class NullControls : public Controls { public:
+	PLUGIN(NullControls);
+	
+	NullControls();
+	
+	virtual bool key_pressed(int keycode);
+	virtual bool mouse_button(int button);
+	virtual ivec2 mouse_pos();
+	virtual void mouse_pos(ivec2 newpos);
+	virtual int scroll_rel();
+	
+private:
+	ivec2 mousepos = ivec2(0,0);
+};
+
+#endif
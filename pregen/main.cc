@@ -0,0 +1,175 @@
+#include "base/common.h"
+#include "base/plugins.h"
+#include "base/blocks.h"
+#include "base/terrain.h"
+#include "base/fileformat.h"
+#include "threadpool/pool.h"
+
+#include <sstream>
+#include <algorithm>
+#include <condition_variable>
+#include <filesystem>
+
+#ifndef _WIN32
+#include <sys/resource.h>
+#endif
+
+/*
+Generates and saves the chunks around a point ahead of time, so they are
+loaded instead of generated when the game is played. Run like:
+
+./scrolls-pregen pregen_seed=12345 pregen_center=0,0,0 pregen_radius=16 pregen_threads=4
+
+Chunks that are already saved are skipped, so a stopped run can be started
+again. Each chunk is decorated with the parts of all the structures that
+reach into it (see StructureDecorator), so chunks from earlier runs are
+already complete. At most pregen_max_chunks chunks are kept in memory at once.
+
+Plugins and parameters can be passed in the same way as for scrolls.
+*/
+
+int PARAM(pregen_seed) = 12345;
+// in blocks, as x,y,z
+string PARAM(pregen_center) = string("0,0,0");
+// in chunks
+int PARAM(pregen_radius) = 8;
+int PARAM(pregen_threads) = 4;
+int PARAM(pregen_max_chunks) = 16;
+// the same chunks as SingleGame saves
+int PARAM(pregen_chunk_size) = 8;
+// levels of the octree generated below each chunk, or -1 for down to single blocks
+int PARAM(pregen_depth) = -1;
+string PARAM(pregen_dir) = string("world/chunks/");
+bool PARAM(pregen_decorate) = true;
+
+
+// in kilobytes
+int64 peak_memory() {
+#ifndef _WIN32
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_maxrss;
+#else
+	return 0;
+#endif
+}
+
+int floordiv(int a, int b) {
+	return a / b - (a % b != 0 and (a < 0) != (b < 0));
+}
+
+struct Progress {
+	std::mutex lock;
+	std::condition_variable changed;
+	int total = 0;
+	int generated = 0;
+	int skipped = 0;
+	int inmemory = 0;
+	double starttime = 0;
+	double lastreport = 0;
+
+	// call with the lock held
+	void report(bool force) {
+		double now = getTime();
+		if (!force and now - lastreport < 1) {
+			return;
+		}
+		lastreport = now;
+		double time = now - starttime;
+		cout << "pregen: " << generated + skipped << "/" << total << " chunks ("
+			<< skipped << " skipped), " << (time > 0 ? generated / time : 0) << " chunks/s, "
+			<< inmemory << " in memory, peak " << peak_memory() << " kb" << endl;
+	}
+};
+
+int main(int numargs, char** args) {
+	pluginloader()->load(numargs-1, args+1);
+
+	ivec3 center;
+	char sep;
+	std::istringstream centerstream (pregen_center);
+	if (!(centerstream >> center.x >> sep >> center.y >> sep >> center.z)) {
+		std::cerr << "ERR: pregen_center should be x,y,z, not '" << pregen_center << "'" << endl;
+		return 1;
+	}
+
+	// the closest chunks are made first, so a run that is
+	// stopped early still has the area around the center
+	int size = pregen_chunk_size;
+	int depth = pregen_depth < 0 ? TerrainGenerator::full_depth(size) : pregen_depth;
+	ivec3 centerchunk (floordiv(center.x, size), floordiv(center.y, size), floordiv(center.z, size));
+	vector<ivec3> offsets;
+	for (int x = -pregen_radius; x <= pregen_radius; x ++) {
+		for (int y = -pregen_radius; y <= pregen_radius; y ++) {
+			for (int z = -pregen_radius; z <= pregen_radius; z ++) {
+				if (x*x + y*y + z*z <= pregen_radius*pregen_radius) {
+					offsets.push_back(ivec3(x,y,z));
+				}
+			}
+		}
+	}
+	std::stable_sort(offsets.begin(), offsets.end(), [] (ivec3 a, ivec3 b) {
+		return a.x*a.x + a.y*a.y + a.z*a.z < b.x*b.x + b.y*b.y + b.z*b.z;
+	});
+
+	std::error_code error;
+	std::filesystem::create_directories(pregen_dir, error);
+
+	TerrainGenerator* generator = TerrainGenerator::plugnew(pregen_seed);
+	TerrainDecorator* decorator = TerrainDecorator::plugnew(generator);
+	BlockFileSystem* filesystem = BlockFileSystem::plugnew(pregen_dir.c_str());
+
+	Progress progress;
+	progress.total = offsets.size();
+	progress.starttime = getTime();
+
+	{
+		Pool pool (pregen_threads);
+		for (ivec3 offset : offsets) {
+			ivec3 position = (centerchunk + offset) * size;
+
+			std::unique_lock guard(progress.lock);
+			if (filesystem->has_file(position, size)) {
+				progress.skipped ++;
+				progress.report(false);
+				continue;
+			}
+
+			while (progress.inmemory >= pregen_max_chunks) {
+				progress.changed.wait_for(guard, std::chrono::seconds(1));
+				progress.report(false);
+			}
+			progress.inmemory ++;
+			guard.unlock();
+
+			pool.pushJob([&, position] () {
+				BlockContainer chunk (position, size);
+				generator->generate_chunk(chunk, depth);
+				if (pregen_decorate) {
+					decorator->decorate_chunk(chunk);
+				}
+				filesystem->to_file(chunk);
+
+				std::lock_guard guard(progress.lock);
+				progress.inmemory --;
+				progress.generated ++;
+				progress.changed.notify_all();
+			});
+		}
+
+		std::unique_lock guard(progress.lock);
+		while (progress.inmemory > 0) {
+			progress.changed.wait_for(guard, std::chrono::seconds(1));
+			progress.report(false);
+		}
+	}
+
+	progress.report(true);
+	double time = getTime() - progress.starttime;
+	cout << "pregen: done, generated " << progress.generated << " chunks and skipped "
+		<< progress.skipped << " in " << time << "s" << endl;
+
+	plugdelete(filesystem);
+	plugdelete(decorator);
+	plugdelete(generator);
+}